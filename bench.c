@@ -0,0 +1,770 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "bench.h"
+#include "shard.h"
+#include "frozen.h"
+#include "shmtree.h"
+#include "learned.h"
+#include "verify.h"
+#include "nodepool.h"
+/*
+ * "bench.c", by Sean Soderman
+ * Benchmarks comparing the different ways the tree can do the same job.
+ * Each one times every operation on its own, so the long tail shows up
+ * next to the total.
+ */
+
+//Current time in nanoseconds, from a clock that never jumps.
+static uint64_t nanotime();
+//Prints the total and the latency percentiles of len timed operations.
+//Sorts lat in place.
+static void report(const char * name, uint64_t * lat, uint64_t len);
+//Orders latencies for qsort.
+static int latcmp(const void * a, const void * b);
+//A plain array-based binary min-heap, as the baseline for timerbench.
+typedef struct h {
+   float * vals;
+   uint64_t len;
+}heap;
+//Adds val to the heap, sifting it up.
+static void heappush(heap * h, float val);
+//Removes and returns the heap's smallest value, sifting the hole down.
+static float heappop(heap * h);
+//Fills an array with len random keys, the same way treetest does.
+static float * randkeys(uint64_t len, unsigned int seed);
+//One thread's share of shardbench's keys, and where they go: into s if it
+//is set, otherwise into t while holding lock.
+typedef struct j {
+   float * keys;
+   uint64_t len;
+   sharded * s;
+   tree * t;
+   pthread_mutex_t * lock;
+}benchjob;
+//Inserts one benchjob's keys one at a time.
+static void * benchworker(void * arg);
+//Nodes each allocbench thread holds at once before freeing them.
+#define ALLOC_ROUND 1000
+//One thread's share of allocbench's rounds. Each round the thread fills
+//its slice of held, then frees a slice: its own, or with handoff the next
+//thread's, so that every node is freed by a thread that didn't allocate
+//it. The barrier keeps the threads in step when they hand off.
+typedef struct k {
+   int id;
+   int nthreads;
+   uint64_t rounds;
+   bool pooled;
+   bool handoff;
+   node ** held;
+   pthread_barrier_t * step;
+   //For the tree runs: keys to insert and then remove, into t.
+   float * keys;
+   uint64_t len;
+   tree * t;
+}allocjob;
+//Runs one allocjob's rounds of node allocation.
+static void * allocworker(void * arg);
+//Inserts one allocjob's keys into its tree and removes them, twice.
+static void * churnworker(void * arg);
+//Runs the first nthreads jobs to completion and returns the time taken.
+static uint64_t runjobs(allocjob * jobs, int nthreads,
+                        void * (* work)(void *));
+
+void deletebench(uint64_t num_to_insert, uint64_t num_to_delete) {
+   unsigned int seed = (unsigned int)time(NULL);
+   float * keys = randkeys(num_to_insert, seed);
+   uint64_t * lat = malloc(sizeof(uint64_t) * (num_to_delete + 1));
+   uint64_t i = 0;
+   int pass = 0;
+   num_to_delete = num_to_delete > num_to_insert ?
+                                   num_to_insert : num_to_delete;
+   for (pass = 0; pass < 2; pass++) {
+      tree * t = create();
+      for (i = 0; i < num_to_insert; i++)
+         insert(keys[i], t);
+      for (i = 0; i < num_to_delete; i++) {
+         uint64_t start = nanotime();
+         if (pass == 0)
+            rmval(keys[i], t);
+         else
+            rmval_topdown(keys[i], t);
+         lat[i] = nanotime() - start;
+      }
+      if (!isvalid(t->root))
+         fprintf(stderr, "Tree is invalid after deleting!\n");
+      report(pass == 0 ? "rmval" : "rmval_topdown", lat, num_to_delete);
+      deltree(t);
+   }
+   free(lat);
+   free(keys);
+}
+
+void insertbench(uint64_t num_to_insert) {
+   const char * names[] = {"random", "sequential", "almost-sorted"};
+   uint64_t * lat = malloc(sizeof(uint64_t) * (num_to_insert + 1));
+   char label[64];
+   uint64_t i = 0;
+   int workload = 0;
+   int fingers = 0;
+   for (workload = 0; workload < 3; workload++) {
+      float * keys = randkeys(num_to_insert, (unsigned int)time(NULL));
+      //Ascending keys, or ascending keys each nudged up to 64 places.
+      for (i = 0; workload > 0 && i < num_to_insert; i++)
+         keys[i] = (float)i + (workload == 2 ? (float)(rand() % 64) : 0);
+      for (fingers = 0; fingers < 2; fingers++) {
+         tree * t = create();
+         t->fingers = fingers;
+         for (i = 0; i < num_to_insert; i++) {
+            uint64_t start = nanotime();
+            insert(keys[i], t);
+            lat[i] = nanotime() - start;
+         }
+         if (!isvalid(t->root))
+            fprintf(stderr, "Tree is invalid after inserting!\n");
+         snprintf(label, sizeof(label), "%s%s", names[workload],
+                  fingers ? "+finger" : "");
+         report(label, lat, num_to_insert);
+         deltree(t);
+      }
+      free(keys);
+   }
+   free(lat);
+}
+
+void bufferbench(uint64_t num_to_insert) {
+   const uint32_t sizes[] = {0, 256, 4096, 65536};
+   float * keys = randkeys(num_to_insert, (unsigned int)time(NULL));
+   uint64_t * lat = malloc(sizeof(uint64_t) * (num_to_insert + 1));
+   char label[64];
+   uint64_t i = 0;
+   uint64_t found = 0;
+   int run = 0;
+   for (run = 0; run < 4; run++) {
+      tree * t = create_buffered(sizes[run]);
+      for (i = 0; i < num_to_insert; i++) {
+         uint64_t start = nanotime();
+         insert(keys[i], t);
+         lat[i] = nanotime() - start;
+      }
+      snprintf(label, sizeof(label), "insert, buffer %u", sizes[run]);
+      report(label, lat, num_to_insert);
+      //Odd positions look up inserted keys, even ones keys that are absent.
+      for (i = 0; i < num_to_insert; i++) {
+         float key = i % 2 ? keys[i] : keys[i] + 0.5f;
+         uint64_t start = nanotime();
+         found += contains(key, t);
+         lat[i] = nanotime() - start;
+      }
+      snprintf(label, sizeof(label), "lookup, buffer %u", sizes[run]);
+      report(label, lat, num_to_insert);
+      deltree(t);
+   }
+   if (found == 0)
+      fprintf(stderr, "No lookups hit!\n");
+   free(lat);
+   free(keys);
+}
+
+/*
+ * Keys are even integers below 2^24, which floats hold exactly, so adding
+ * one makes a miss that lands right next to a present key.
+ */
+void filterbench(uint64_t num_to_insert) {
+   const char * names[] = {"present", "absent", "removed"};
+   float * keys = malloc(sizeof(float) * (num_to_insert + 1));
+   uint64_t * lat = malloc(sizeof(uint64_t) * (num_to_insert + 1));
+   char label[64];
+   uint64_t i = 0;
+   uint64_t found = 0;
+   int filtered = 0;
+   int kind = 0;
+   srand((unsigned int)time(NULL));
+   for (i = 0; i < num_to_insert; i++)
+      keys[i] = (float)((rand() & 0x7fffff) * 2);
+   for (filtered = 0; filtered < 2; filtered++) {
+      tree * t = create();
+      tree_filter(t, filtered);
+      for (i = 0; i < num_to_insert; i++)
+         insert(keys[i], t);
+      for (kind = 0; kind < 3; kind++) {
+         //The last pass looks up the half that was just taken back out.
+         for (i = 0; kind == 2 && i < num_to_insert / 2; i++)
+            rmval(keys[i], t);
+         uint64_t len = kind == 2 ? num_to_insert / 2 : num_to_insert;
+         for (i = 0; i < len; i++) {
+            float key = kind == 1 ? keys[i] + 1 : keys[i];
+            uint64_t start = nanotime();
+            found += contains(key, t);
+            lat[i] = nanotime() - start;
+         }
+         snprintf(label, sizeof(label), "%s%s", names[kind],
+                  filtered ? "+filter" : "");
+         report(label, lat, len);
+      }
+      tree_stats(t);
+      deltree(t);
+   }
+   if (found == 0)
+      fprintf(stderr, "No lookups hit!\n");
+   free(lat);
+   free(keys);
+}
+
+/*
+ * Wall-clock time is what matters here, so only the whole run is timed.
+ * The sharded tree gets four shards per thread so that two threads are
+ * seldom after the same shard at once.
+ */
+void shardbench(uint64_t num_to_insert, int num_threads) {
+   const char * names[] = {"one tree + lock", "sharded", "sharded batch"};
+   float * keys = randkeys(num_to_insert, (unsigned int)time(NULL));
+   float * out = malloc(sizeof(float) * (num_to_insert + 1));
+   pthread_t * threads = malloc(sizeof(pthread_t) * num_threads);
+   benchjob * jobs = malloc(sizeof(benchjob) * num_threads);
+   pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+   int run = 0;
+   int i = 0;
+   for (run = 0; run < 3; run++) {
+      tree * t = create();
+      sharded * s = create_sharded(num_threads * 4);
+      uint64_t start = nanotime();
+      if (run == 2)
+         sharded_insert_batch(keys, num_to_insert, s);
+      else {
+         for (i = 0; i < num_threads; i++) {
+            jobs[i].keys = keys + num_to_insert * i / num_threads;
+            jobs[i].len = num_to_insert * (i + 1) / num_threads -
+                          num_to_insert * i / num_threads;
+            jobs[i].s = run == 1 ? s : NULL;
+            jobs[i].t = t;
+            jobs[i].lock = &lock;
+            pthread_create(&threads[i], NULL, benchworker, &jobs[i]);
+         }
+         for (i = 0; i < num_threads; i++)
+            pthread_join(threads[i], NULL);
+      }
+      uint64_t total = nanotime() - start;
+      printf("%-24s %10llu ops, %d threads, total %.3f s, ns/op %llu\n",
+             names[run], (unsigned long long)num_to_insert, num_threads,
+             total / 1e9, (unsigned long long)(total / num_to_insert));
+      if (run > 0 && sharded_range(-INFINITY, INFINITY, s, out,
+                                   num_to_insert) != num_to_insert)
+         fprintf(stderr, "Sharded tree lost keys!\n");
+      delsharded(s);
+      deltree(t);
+   }
+   free(keys);
+   free(out);
+   free(threads);
+   free(jobs);
+}
+
+/*
+ * Deadlines are "now" plus up to TIMER_SPAN ticks, like a scheduler's
+ * timers. Both queues see exactly the same sequence of delays.
+ */
+void timerbench(uint64_t num_timers, uint64_t num_ops) {
+   const int TIMER_SPAN = 1 << 16;
+   unsigned int seed = (unsigned int)time(NULL);
+   uint64_t * lat = malloc(sizeof(uint64_t) * (num_ops + 1));
+   uint64_t i = 0;
+   int pass = 0;
+   for (pass = 0; pass < 2; pass++) {
+      tree * t = create();
+      heap h = {malloc(sizeof(float) * (num_timers + 1)), 0};
+      float now = 0;
+      srand(seed);
+      for (i = 0; i < num_timers; i++) {
+         float deadline = (float)(rand() % TIMER_SPAN);
+         if (pass == 0)
+            insert(deadline, t);
+         else
+            heappush(&h, deadline);
+      }
+      for (i = 0; i < num_ops; i++) {
+         float delay = (float)(1 + rand() % TIMER_SPAN);
+         uint64_t start = nanotime();
+         if (pass == 0) {
+            (void)pop_min(t, &now);
+            insert(now + delay, t);
+         }
+         else {
+            //An empty queue keeps "now", the same as a failed pop_min.
+            if (h.len > 0)
+               now = heappop(&h);
+            heappush(&h, now + delay);
+         }
+         lat[i] = nanotime() - start;
+      }
+      report(pass == 0 ? "tree pop_min+insert" : "heap pop+push", lat,
+             num_ops);
+      free(h.vals);
+      deltree(t);
+   }
+   free(lat);
+}
+
+static void heappush(heap * h, float val) {
+   uint64_t i = h->len++;
+   while (i > 0 && h->vals[(i - 1) / 2] > val) {
+      h->vals[i] = h->vals[(i - 1) / 2];
+      i = (i - 1) / 2;
+   }
+   h->vals[i] = val;
+}
+
+static float heappop(heap * h) {
+   float top = h->vals[0];
+   float last = h->vals[--h->len];
+   uint64_t i = 0;
+   while (2 * i + 1 < h->len) {
+      uint64_t child = 2 * i + 1;
+      if (child + 1 < h->len && h->vals[child + 1] < h->vals[child])
+         child++;
+      if (h->vals[child] >= last)
+         break;
+      h->vals[i] = h->vals[child];
+      i = child;
+   }
+   h->vals[i] = last;
+   return top;
+}
+
+static uint64_t nanotime() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char * name, uint64_t * lat, uint64_t len) {
+   uint64_t total = 0;
+   uint64_t i = 0;
+   if (len == 0)
+      return;
+   for (i; i < len; i++)
+      total += lat[i];
+   qsort(lat, len, sizeof(uint64_t), latcmp);
+   printf("%-24s %10llu ops, total %.3f s, ns/op: mean %llu, p50 %llu, "
+          "p99 %llu, p99.9 %llu, max %llu\n", name,
+          (unsigned long long)len, total / 1e9,
+          (unsigned long long)(total / len),
+          (unsigned long long)lat[len / 2],
+          (unsigned long long)lat[len * 99 / 100],
+          (unsigned long long)lat[len * 999 / 1000],
+          (unsigned long long)lat[len - 1]);
+}
+
+static int latcmp(const void * a, const void * b) {
+   uint64_t x = *(const uint64_t *)a;
+   uint64_t y = *(const uint64_t *)b;
+   return (x > y) - (x < y);
+}
+
+static float * randkeys(uint64_t len, unsigned int seed) {
+   float * keys = malloc(sizeof(float) * (len + 1));
+   uint64_t i = 0;
+   srand(seed);
+   for (i; i < len; i++)
+      keys[i] = (float)(rand());
+   return keys;
+}
+
+static void * benchworker(void * arg) {
+   benchjob * job = arg;
+   uint64_t i = 0;
+   for (i = 0; i < job->len; i++) {
+      if (job->s != NULL)
+         sharded_insert(job->keys[i], job->s);
+      else {
+         pthread_mutex_lock(job->lock);
+         insert(job->keys[i], job->t);
+         pthread_mutex_unlock(job->lock);
+      }
+   }
+   return NULL;
+}
+
+/*
+ * A million random even keys below 2^24 sit about sixteen apart, so the
+ * frozen copy packs most blocks at well under a byte per key.
+ */
+void freezebench(uint64_t num_to_insert) {
+   float * keys = malloc(sizeof(float) * (num_to_insert + 1));
+   uint64_t * lat = malloc(sizeof(uint64_t) * (num_to_insert + 1));
+   uint64_t i = 0;
+   uint64_t found = 0;
+   int kind = 0;
+   srand((unsigned int)time(NULL));
+   for (i = 0; i < num_to_insert; i++)
+      keys[i] = (float)((rand() & 0x7fffff) * 2);
+   tree * t = create();
+   bulkload(keys, num_to_insert, t);
+   frozen * fz = tree_freeze(t);
+   tree_stats(t);
+   printf("frozen: %llu bytes, %.2f bytes per key\n",
+          (unsigned long long)frozen_bytes(fz),
+          num_to_insert ? (double)frozen_bytes(fz) / num_to_insert : 0.0);
+   //Odd keys are never stored, so kind 1 misses every time.
+   for (kind = 0; kind < 4; kind++) {
+      bool cold = kind >= 2;
+      for (i = 0; i < num_to_insert; i++) {
+         float key = kind & 1 ? keys[i] + 1 : keys[i];
+         uint64_t start = nanotime();
+         found += cold ? frozen_contains(key, fz) : contains(key, t);
+         lat[i] = nanotime() - start;
+      }
+      report(kind & 1 ? (cold ? "frozen absent" : "tree absent") :
+                        (cold ? "frozen present" : "tree present"),
+             lat, num_to_insert);
+   }
+   if (found == 0)
+      fprintf(stderr, "No lookups hit!\n");
+   delfrozen(fz);
+   deltree(t);
+   free(lat);
+   free(keys);
+}
+
+/*
+ * The first half of the keys goes into the shared tree before the readers
+ * start. While they run, the second half is inserted and then the first
+ * half removed, so their searches race real writes. Each reader looks up
+ * every key, and what it finds depends on how far the writer has got.
+ */
+void shmbench(uint64_t num_to_insert, int num_readers) {
+   float * keys = malloc(sizeof(float) * (num_to_insert + 1));
+   char name[64];
+   uint64_t i = 0;
+   int r = 0;
+   srand((unsigned int)time(NULL));
+   for (i = 0; i < num_to_insert; i++)
+      keys[i] = (float)((rand() & 0x7fffff) * 2);
+   snprintf(name, sizeof(name), "/mktree-%d", (int)getpid());
+   shmtree * sh = create_shmtree(name, num_to_insert);
+   if (sh == NULL) {
+      perror(name);
+      free(keys);
+      return;
+   }
+   uint64_t half = num_to_insert / 2;
+   uint64_t * ilat = malloc(sizeof(uint64_t) * (num_to_insert - half + 1));
+   uint64_t * dlat = malloc(sizeof(uint64_t) * (half + 1));
+   for (i = 0; i < half; i++)
+      shmtree_insert(keys[i], sh);
+   fflush(stdout);
+   for (r = 0; r < num_readers; r++) {
+      if (fork() != 0)
+         continue;
+      //Each reader maps the segment on its own, as an unrelated process
+      //would, rather than using the mapping it inherited.
+      shmtree * mine = open_shmtree(name);
+      uint64_t * rlat = malloc(sizeof(uint64_t) * (num_to_insert + 1));
+      uint64_t found = 0;
+      char label[64];
+      for (i = 0; mine != NULL && i < num_to_insert; i++) {
+         uint64_t start = nanotime();
+         found += shmtree_contains(keys[i], mine);
+         rlat[i] = nanotime() - start;
+      }
+      if (mine != NULL) {
+         snprintf(label, sizeof(label), "reader %d", r);
+         report(label, rlat, num_to_insert);
+         printf("reader %d: %llu found, %llu retries\n", r,
+                (unsigned long long)found,
+                (unsigned long long)mine->retries);
+         delshmtree(mine);
+      }
+      fflush(stdout);
+      _exit(0);
+   }
+   for (i = half; i < num_to_insert; i++) {
+      uint64_t start = nanotime();
+      shmtree_insert(keys[i], sh);
+      ilat[i - half] = nanotime() - start;
+   }
+   for (i = 0; i < half; i++) {
+      uint64_t start = nanotime();
+      shmtree_rmval(keys[i], sh);
+      dlat[i] = nanotime() - start;
+   }
+   while (wait(NULL) > 0)
+      ;
+   report("shared insert", ilat, num_to_insert - half);
+   report("shared rmval", dlat, half);
+   printf("shared tree holds %llu keys\n",
+          (unsigned long long)shmtree_len(sh));
+   delshmtree(sh);
+   free(ilat);
+   free(dlat);
+   free(keys);
+}
+
+/*
+ * Every key is a whole number below 2^22, where floats still have room
+ * for halves, so key + 0.5 is always a miss. Clustered keys bunch up in
+ * 64 narrow runs with empty space between them.
+ */
+void learnbench(uint64_t num_to_insert) {
+   const char * names[] = {"uniform", "sequential", "clustered"};
+   float * keys = malloc(sizeof(float) * (num_to_insert + 1));
+   uint64_t * lat = malloc(sizeof(uint64_t) * (num_to_insert + 1));
+   sortkey centers[64];
+   char label[64];
+   uint64_t i = 0;
+   uint64_t found = 0;
+   int dist = 0;
+   int kind = 0;
+   srand((unsigned int)time(NULL));
+   for (i = 0; i < 64; i++)
+      centers[i] = rand() & 0x3f0000;
+   for (dist = 0; dist < 3; dist++) {
+      for (i = 0; i < num_to_insert; i++) {
+         if (dist == 0)
+            keys[i] = (float)(rand() & 0x3fffff);
+         else if (dist == 1)
+            keys[i] = (float)(i & 0x3fffff);
+         else
+            keys[i] = (float)(centers[rand() & 63] + (rand() & 0xffff));
+      }
+      tree * t = create();
+      bulkload(keys, num_to_insert, t);
+      learned * li = tree_learn(t);
+      printf("%s: %llu segments, %llu bytes\n", names[dist],
+             (unsigned long long)li->nsegs,
+             (unsigned long long)learned_bytes(li));
+      //bulkload left keys sorted, so look them up in a shuffled order.
+      for (i = num_to_insert; i > 1; i--) {
+         uint64_t j = (uint64_t)rand() % i;
+         float tmp = keys[i - 1];
+         keys[i - 1] = keys[j];
+         keys[j] = tmp;
+      }
+      for (kind = 0; kind < 4; kind++) {
+         bool model = kind >= 2;
+         for (i = 0; i < num_to_insert; i++) {
+            float key = kind & 1 ? keys[i] + 0.5f : keys[i];
+            uint64_t start = nanotime();
+            found += model ? learned_contains(key, li) : contains(key, t);
+            lat[i] = nanotime() - start;
+         }
+         snprintf(label, sizeof(label), "%s %s %s", names[dist],
+                  model ? "learned" : "descent", kind & 1 ? "miss" : "hit");
+         report(label, lat, num_to_insert);
+      }
+      printf("%s: %llu lookups fell back to descent\n", names[dist],
+             (unsigned long long)li->fallbacks);
+      dellearned(li);
+      deltree(t);
+   }
+   if (found == 0)
+      fprintf(stderr, "No lookups hit!\n");
+   free(lat);
+   free(keys);
+}
+
+void verifybench(uint64_t num_to_insert) {
+   float * keys = randkeys(num_to_insert, (unsigned int)time(NULL));
+   tree * t = create();
+   int threads = 1;
+   bulkload(keys, num_to_insert, t);
+   uint64_t start = nanotime();
+   bool valid = isvalid(t->root);
+   printf("isvalid: %s, %.3f s\n", valid ? "valid" : "invalid",
+          (nanotime() - start) / 1e9);
+   for (threads = 1; threads <= 8; threads *= 2) {
+      start = nanotime();
+      verify_report rep = tree_verify(t, threads);
+      uint64_t took = nanotime() - start;
+      printf("tree_verify, %d thread%s: %s, %llu keys in %llu nodes, "
+             "height %llu, %.3f s\n", threads, threads == 1 ? "" : "s",
+             verify_describe(rep.code), (unsigned long long)rep.keys,
+             (unsigned long long)rep.nodes, (unsigned long long)rep.height,
+             took / 1e9);
+   }
+   deltree(t);
+   free(keys);
+}
+
+/*
+ * The lazy tree has room for every tombstone the burst makes, so the burst
+ * sweeps nothing and the mixed phase's inserts pay for it instead. In
+ * between, pop_min works its way up through the burst's tombstones,
+ * removing the dead copies it passes and no others.
+ */
+void lazybench(uint64_t num_to_insert) {
+   uint64_t quarter = num_to_insert / 4;
+   float * keys = randkeys(num_to_insert * 2, (unsigned int)time(NULL));
+   uint64_t * dlat = malloc(sizeof(uint64_t) * (quarter + 1));
+   uint64_t * ilat = malloc(sizeof(uint64_t) * (quarter + 1));
+   uint64_t hits[2];
+   uint64_t i = 0;
+   int lazy = 0;
+   for (lazy = 0; lazy < 2; lazy++) {
+      tree * t = create();
+      for (i = 0; i < num_to_insert; i++)
+         insert(keys[i], t);
+      if (lazy)
+         tree_lazy(t, (uint32_t)(quarter + 1));
+      for (i = 0; i < quarter; i++) {
+         uint64_t start = nanotime();
+         rmval(keys[i], t);
+         dlat[i] = nanotime() - start;
+      }
+      report(lazy ? "lazy rmval, burst" : "rmval, burst", dlat, quarter);
+      for (i = 0; i < quarter; i++) {
+         float popped;
+         uint64_t start = nanotime();
+         rmval(keys[quarter * 2 + i], t);
+         dlat[i] = nanotime() - start;
+         start = nanotime();
+         pop_min(t, &popped);
+         ilat[i] = nanotime() - start;
+      }
+      report(lazy ? "lazy rmval, with pops" : "rmval, with pops", dlat,
+             quarter);
+      report(lazy ? "pop_min (lazy)" : "pop_min", ilat, quarter);
+      for (i = 0; i < quarter; i++) {
+         uint64_t start = nanotime();
+         rmval(keys[quarter + i], t);
+         dlat[i] = nanotime() - start;
+         start = nanotime();
+         insert(keys[num_to_insert + i], t);
+         ilat[i] = nanotime() - start;
+      }
+      report(lazy ? "lazy rmval, mixed" : "rmval, mixed", dlat, quarter);
+      report(lazy ? "insert, mixed (lazy)" : "insert, mixed", ilat, quarter);
+      if (lazy) {
+         tree_stats(t);
+         uint64_t start = nanotime();
+         tree_flush(t);
+         printf("sweeping the rest: %.3f s\n", (nanotime() - start) / 1e9);
+      }
+      //Keys repeat, so a deleted key may still be found; both trees
+      //should just agree on which ones are.
+      hits[lazy] = 0;
+      for (i = 0; i < num_to_insert * 2; i++)
+         hits[lazy] += contains(keys[i], t);
+      if (lazy && hits[0] != hits[1])
+         fprintf(stderr, "Lazy and eager trees disagree!\n");
+      deltree(t);
+   }
+   free(keys);
+   free(dlat);
+   free(ilat);
+}
+
+/*
+ * malloc has per-thread arenas of its own, so it is the fair baseline for
+ * the pool. The tree runs give each thread its own tree, so the only thing
+ * the threads could contend on is the allocator.
+ */
+void allocbench(uint64_t num_ops, int num_threads) {
+   const char * names[] = {"malloc, own nodes", "pool, own nodes",
+                           "malloc, handed off", "pool, handed off"};
+   if (num_threads < 1)
+      num_threads = 1;
+   uint64_t rounds = num_ops / num_threads / ALLOC_ROUND + 1;
+   uint64_t ops = rounds * ALLOC_ROUND * num_threads;
+   node ** held = malloc(sizeof(node *) * ALLOC_ROUND * num_threads);
+   allocjob * jobs = malloc(sizeof(allocjob) * num_threads);
+   float * keys = randkeys(num_ops, (unsigned int)time(NULL));
+   pthread_barrier_t step;
+   int run = 0;
+   int i = 0;
+   pthread_barrier_init(&step, NULL, num_threads);
+   for (run = 0; run < 4; run++) {
+      for (i = 0; i < num_threads; i++) {
+         jobs[i].id = i;
+         jobs[i].nthreads = num_threads;
+         jobs[i].rounds = rounds;
+         jobs[i].pooled = run % 2 == 1;
+         jobs[i].handoff = run >= 2;
+         jobs[i].held = held;
+         jobs[i].step = &step;
+      }
+      uint64_t total = runjobs(jobs, num_threads, allocworker);
+      printf("%-24s %10llu allocs, %d threads, total %.3f s, ns/op %llu\n",
+             names[run], (unsigned long long)ops, num_threads, total / 1e9,
+             (unsigned long long)(total / ops));
+   }
+   for (run = 0; run < 2; run++) {
+      for (i = 0; i < num_threads; i++) {
+         jobs[i].keys = keys + num_ops * i / num_threads;
+         jobs[i].len = num_ops * (i + 1) / num_threads -
+                       num_ops * i / num_threads;
+         jobs[i].t = run == 1 ? create_pooled() : create();
+      }
+      uint64_t total = runjobs(jobs, num_threads, churnworker);
+      printf("%-24s %10llu ops, %d threads, total %.3f s, ns/op %llu\n",
+             run == 1 ? "trees, shared pool" : "trees, own allocators",
+             (unsigned long long)(num_ops * 4), num_threads, total / 1e9,
+             (unsigned long long)(total / (num_ops * 4 + 1)));
+      if (run == 1)
+         tree_stats(jobs[0].t);
+      for (i = 0; i < num_threads; i++)
+         deltree(jobs[i].t);
+   }
+   pthread_barrier_destroy(&step);
+   free(held);
+   free(jobs);
+   free(keys);
+}
+
+static void * allocworker(void * arg) {
+   allocjob * job = arg;
+   node ** mine = job->held + job->id * ALLOC_ROUND;
+   node ** theirs = job->handoff ?
+                    job->held + (job->id + 1) % job->nthreads * ALLOC_ROUND :
+                    mine;
+   uint64_t r = 0;
+   uint64_t i = 0;
+   for (r = 0; r < job->rounds; r++) {
+      for (i = 0; i < ALLOC_ROUND; i++) {
+         mine[i] = job->pooled ? nodepool_get() : malloc(sizeof(node));
+         mine[i]->epoch = r;
+      }
+      if (job->handoff)
+         pthread_barrier_wait(job->step);
+      for (i = 0; i < ALLOC_ROUND; i++) {
+         if (job->pooled)
+            nodepool_put(theirs[i]);
+         else
+            free(theirs[i]);
+      }
+      if (job->handoff)
+         pthread_barrier_wait(job->step);
+   }
+   return NULL;
+}
+
+static void * churnworker(void * arg) {
+   allocjob * job = arg;
+   uint64_t i = 0;
+   int pass = 0;
+   for (pass = 0; pass < 2; pass++) {
+      for (i = 0; i < job->len; i++)
+         insert(job->keys[i], job->t);
+      for (i = 0; i < job->len; i++)
+         rmval(job->keys[i], job->t);
+   }
+   return NULL;
+}
+
+static uint64_t runjobs(allocjob * jobs, int nthreads,
+                        void * (* work)(void *)) {
+   pthread_t * threads = malloc(sizeof(pthread_t) * nthreads);
+   uint64_t start = nanotime();
+   int i = 0;
+   for (i = 0; i < nthreads; i++)
+      pthread_create(&threads[i], NULL, work, &jobs[i]);
+   for (i = 0; i < nthreads; i++)
+      pthread_join(threads[i], NULL);
+   uint64_t total = nanotime() - start;
+   free(threads);
+   return total;
+}
@@ -0,0 +1,61 @@
+/*
+ * "bench.h", by Sean Soderman
+ * Specification of the benchmarks mktree can run.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "tree23.h"
+
+//Times rmval against rmval_topdown on the treetest workload: the same
+//random keys inserted, then the first num_to_delete of them removed.
+void deletebench(uint64_t num_to_insert, uint64_t num_to_delete);
+
+//Times num_to_insert inserts with and without the insert finger, for
+//random, ascending and almost-sorted keys.
+void insertbench(uint64_t num_to_insert);
+
+//Runs a timer queue holding num_timers deadlines for num_ops steps, each
+//expiring the earliest timer and arming a new one a random delay later.
+//Compares pop_min + insert with an array-based binary heap.
+void timerbench(uint64_t num_timers, uint64_t num_ops);
+
+//Inserts num_to_insert random keys into an unbuffered tree and into
+//buffered trees of a few sizes, then times as many lookups in each.
+void bufferbench(uint64_t num_to_insert);
+
+//Times lookups of present, absent and removed keys with and without the
+//tree's Bloom filter, then prints the filter's stats.
+void filterbench(uint64_t num_to_insert);
+
+//Inserts num_to_insert random keys from num_threads threads, into one tree
+//behind one lock, into a sharded tree, and as a single sharded batch.
+void shardbench(uint64_t num_to_insert, int num_threads);
+
+//Builds a tree of num_to_insert dense keys, freezes it, and compares the
+//two's size and their lookup times for present and absent keys.
+void freezebench(uint64_t num_to_insert);
+
+//Forks num_readers processes that look keys up in a tree kept in shared
+//memory while this process inserts into it and removes from it.
+void shmbench(uint64_t num_to_insert, int num_readers);
+
+//Times lookups through a learned index against plain descent, for
+//uniform, sequential and clustered keys.
+void learnbench(uint64_t num_to_insert);
+
+//Times isvalid against tree_verify on 1, 2, 4 and 8 threads, over a tree
+//bulk loaded with num_to_insert random keys.
+void verifybench(uint64_t num_to_insert);
+
+//Times the shared node pool against malloc, with each thread freeing its
+//own nodes and then another thread's, and then num_threads private trees
+//inserting and removing num_ops keys between them, with and without it.
+void allocbench(uint64_t num_ops, int num_threads);
+
+//Times rmval against lazy rmval on a tree of num_to_insert random keys:
+//first a burst of deletes alone, then deletes mixed with pop_min, then
+//deletes mixed with inserts.
+void lazybench(uint64_t num_to_insert);
+
+#endif
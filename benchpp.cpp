@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+#include "tree23.hpp"
+/*
+ * "benchpp.cpp", by Sean Soderman
+ * Times tree23.hpp against the standard ordered containers, and against a
+ * sorted vector as the cache-friendly end of the scale (it can't take
+ * single inserts or erases, so it sorts once and skips those).
+ */
+
+#ifndef DEFAULT_INSERTS
+#define DEFAULT_INSERTS 1000000ULL
+#endif
+
+//Prints one timed phase, mean time per operation.
+static void report(const char * name, const char * phase, uint64_t ops,
+                   std::chrono::steady_clock::duration took);
+//Adds key to a set, or maps it to 1 in a map.
+template <class C>
+static void add(C & c, float key);
+//Inserts every key, looks every key up, then again one past each (which
+//always misses), walks the whole container, and erases every key.
+template <class C>
+static void run(const char * name, const std::vector<float> & keys);
+//The same, minus the inserts and erases, for a sorted vector.
+static void runvector(const std::vector<float> & keys);
+
+int main(int argc, char * argv[]) {
+   uint64_t num_to_insert = argc >= 2 ? (uint64_t)atoll(argv[1]) :
+                                        DEFAULT_INSERTS;
+   std::mt19937 rng(std::random_device{}());
+   std::vector<float> keys(num_to_insert);
+   //Even keys only, so key + 1 is never in the container.
+   for (float & k : keys)
+      k = (float)((rng() & 0x7fffff) * 2);
+   run<std::set<float>>("std::set", keys);
+   run<tree23<float>>("tree23", keys);
+   run<tree23<float, void, std::less<float>, tree23_pool<float>>>(
+      "tree23+pool", keys);
+   run<std::map<float, int>>("std::map", keys);
+   run<tree23<float, int>>("tree23 map", keys);
+   runvector(keys);
+   return 0;
+}
+
+static void report(const char * name, const char * phase, uint64_t ops,
+                   std::chrono::steady_clock::duration took) {
+   double ns = std::chrono::duration<double, std::nano>(took).count();
+   printf("%-12s %-8s %10llu ops, total %.3f s, ns/op %.1f\n", name, phase,
+          (unsigned long long)ops, ns / 1e9, ops ? ns / ops : 0.0);
+}
+
+template <class C>
+static void add(C & c, float key) {
+   if constexpr (std::is_same<typename C::key_type,
+                              typename C::value_type>::value)
+      c.insert(key);
+   else
+      c.emplace(key, 1);
+}
+
+/*
+ * The sums are printed so the compiler can't throw the lookups away.
+ */
+template <class C>
+static void run(const char * name, const std::vector<float> & keys) {
+   using clock = std::chrono::steady_clock;
+   C c;
+   uint64_t found = 0;
+   double sum = 0;
+   auto start = clock::now();
+   for (float k : keys)
+      add(c, k);
+   report(name, "insert", keys.size(), clock::now() - start);
+   start = clock::now();
+   for (float k : keys)
+      found += c.find(k) != c.end();
+   report(name, "hit", keys.size(), clock::now() - start);
+   start = clock::now();
+   for (float k : keys)
+      found += c.find(k + 1) != c.end();
+   report(name, "miss", keys.size(), clock::now() - start);
+   start = clock::now();
+   for (const auto & v : c) {
+      if constexpr (std::is_same<typename C::key_type,
+                                 typename C::value_type>::value)
+         sum += v;
+      else
+         sum += v.first;
+   }
+   report(name, "iterate", c.size(), clock::now() - start);
+   start = clock::now();
+   for (float k : keys)
+      c.erase(k);
+   report(name, "erase", keys.size(), clock::now() - start);
+   printf("%-12s (%llu found, sum %g, %zu left)\n", name,
+          (unsigned long long)found, sum, c.size());
+}
+
+static void runvector(const std::vector<float> & keys) {
+   using clock = std::chrono::steady_clock;
+   const char * name = "sorted vec";
+   uint64_t found = 0;
+   double sum = 0;
+   auto start = clock::now();
+   std::vector<float> v(keys);
+   std::sort(v.begin(), v.end());
+   v.erase(std::unique(v.begin(), v.end()), v.end());
+   report(name, "build", keys.size(), clock::now() - start);
+   start = clock::now();
+   for (float k : keys)
+      found += std::binary_search(v.begin(), v.end(), k);
+   report(name, "hit", keys.size(), clock::now() - start);
+   start = clock::now();
+   for (float k : keys)
+      found += std::binary_search(v.begin(), v.end(), k + 1);
+   report(name, "miss", keys.size(), clock::now() - start);
+   start = clock::now();
+   for (float k : v)
+      sum += k;
+   report(name, "iterate", v.size(), clock::now() - start);
+   printf("%-12s (%llu found, sum %g)\n", name, (unsigned long long)found,
+          sum);
+}
@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+#include "frozen.h"
+/*
+ * "frozen.c", by Sean Soderman
+ * Frame-of-reference compression of a tree's keys. Everything is done on
+ * the integer keys the tree stores, so gaps are plain subtractions and
+ * every comparison is an unsigned one.
+ */
+
+//Appends every key under n to *keys in order, growing it as needed.
+static void flatten(node * n, sortkey ** keys, uint64_t * len,
+                    uint64_t * cap);
+//Appends k to *keys, growing it as needed.
+static void push(sortkey k, sortkey ** keys, uint64_t * len,
+                 uint64_t * cap);
+//Fills in fz's heads, starts and widths for len keys. Returns the number
+//of bits their gaps pack into.
+static uint64_t layout(sortkey * keys, uint64_t len, frozen * fz);
+//Packs the gaps between keys into fz->packed, which must be zeroed.
+static void pack(sortkey * keys, frozen * fz);
+//Returns the last block whose head is at most k (or below k, if strict),
+//or block 0 if there is none.
+static uint64_t findblock(frozen * fz, sortkey k, bool strict);
+//Number of keys in block b.
+static uint64_t blocklen(frozen * fz, uint64_t b);
+//Reads the 64 bits starting at bit in words. Needs one word of padding
+//past the last bit that matters.
+static uint64_t getbits(const uint64_t * words, uint64_t bit);
+//ORs the low width bits of val into words at bit.
+static void setbits(uint64_t * words, uint64_t bit, int width,
+                    uint64_t val);
+
+/*
+ * Two passes over the sorted keys: the first picks every block's width
+ * so the packed array can be allocated at its exact size, the second
+ * fills it in.
+ */
+frozen * tree_freeze(tree * root) {
+   frozen * fz = malloc(sizeof(frozen));
+   uint64_t len = 0;
+   sortkey * keys = tree_keys(root, &len);
+   uint64_t nblocks = (len + FROZEN_BLOCK - 1) / FROZEN_BLOCK;
+   fz->heads = malloc(sizeof(sortkey) * (nblocks + 1));
+   fz->starts = malloc(sizeof(uint64_t) * (nblocks + 1));
+   fz->widths = malloc(nblocks + 1);
+   fz->packed_len = layout(keys, len, fz) / 64 + 2;
+   fz->packed = calloc(fz->packed_len, sizeof(uint64_t));
+   pack(keys, fz);
+   free(keys);
+   return fz;
+}
+
+bool freeze_into(tree * root, frozen * fz, uint64_t max) {
+   uint64_t len = 0;
+   sortkey * keys = tree_keys(root, &len);
+   bool fits = len <= max;
+   if (fits) {
+      uint64_t words = layout(keys, len, fz) / 64 + 2;
+      memset(fz->packed, 0, sizeof(uint64_t) * words);
+      fz->packed_len = words;
+      pack(keys, fz);
+   }
+   free(keys);
+   return fits;
+}
+
+void delfrozen(frozen * fz) {
+   free(fz->heads);
+   free(fz->starts);
+   free(fz->widths);
+   free(fz->packed);
+   free(fz);
+}
+
+/*
+ * The whole block is decoded every time rather than stopping at the first
+ * key past k: the loop always runs the same number of times, so the only
+ * branch in it is one the predictor never misses.
+ */
+bool frozen_contains(float val, frozen * fz) {
+   sortkey k = tokey(val);
+   uint64_t i = 0;
+   if (fz->len == 0)
+      return false;
+   uint64_t b = findblock(fz, k, false);
+   uint64_t count = blocklen(fz, b);
+   uint64_t bit = fz->starts[b];
+   int width = fz->widths[b];
+   uint64_t mask = (1ULL << width) - 1;
+   sortkey cur = fz->heads[b];
+   bool found = cur == k;
+   for (i = 1; i < count; i++, bit += width) {
+      cur += (sortkey)(getbits(fz->packed, bit) & mask);
+      found |= cur == k;
+   }
+   return found;
+}
+
+/*
+ * Copies of lo may run back into earlier blocks, so the scan starts in
+ * the last block whose head is strictly below lo.
+ */
+uint64_t frozen_range(float lo, float hi, frozen * fz, float * out,
+                      uint64_t max) {
+   sortkey from = tokey(lo);
+   sortkey to = tokey(hi);
+   uint64_t len = 0;
+   uint64_t b = 0;
+   uint64_t i = 0;
+   if (fz->len == 0 || to < from)
+      return 0;
+   for (b = findblock(fz, from, true); b < fz->nblocks && len < max; b++) {
+      uint64_t bit = fz->starts[b];
+      int width = fz->widths[b];
+      uint64_t mask = (1ULL << width) - 1;
+      sortkey cur = fz->heads[b];
+      if (cur > to)
+         break;
+      for (i = 0; i < blocklen(fz, b) && cur <= to && len < max; i++) {
+         if (i > 0) {
+            cur += (sortkey)(getbits(fz->packed, bit) & mask);
+            bit += width;
+         }
+         if (from <= cur && cur <= to)
+            out[len++] = fromkey(cur);
+      }
+   }
+   return len;
+}
+
+uint64_t frozen_bytes(frozen * fz) {
+   return sizeof(frozen) +
+          fz->nblocks * (sizeof(sortkey) + sizeof(uint64_t) + 1) +
+          fz->packed_len * sizeof(uint64_t);
+}
+
+sortkey * tree_keys(tree * root, uint64_t * len) {
+   uint64_t cap = 1024;
+   sortkey * keys = malloc(sizeof(sortkey) * cap);
+   *len = 0;
+   tree_flush(root);
+   flatten(root->root, &keys, len, &cap);
+   return keys;
+}
+
+static uint64_t layout(sortkey * keys, uint64_t len, frozen * fz) {
+   uint64_t bits = 0;
+   uint64_t b = 0;
+   uint64_t i = 0;
+   fz->len = len;
+   fz->nblocks = (len + FROZEN_BLOCK - 1) / FROZEN_BLOCK;
+   for (b = 0; b < fz->nblocks; b++) {
+      uint64_t first = b * FROZEN_BLOCK;
+      sortkey widest = 0;
+      int width = 0;
+      //ORing the gaps together leaves the widest one's top bit set.
+      for (i = first + 1; i < first + blocklen(fz, b); i++)
+         widest |= keys[i] - keys[i - 1];
+      while (width < 32 && (widest >> width) != 0)
+         width++;
+      fz->heads[b] = keys[first];
+      fz->starts[b] = bits;
+      fz->widths[b] = (uint8_t)width;
+      bits += (blocklen(fz, b) - 1) * width;
+   }
+   return bits;
+}
+
+static void pack(sortkey * keys, frozen * fz) {
+   uint64_t b = 0;
+   uint64_t i = 0;
+   for (b = 0; b < fz->nblocks; b++) {
+      uint64_t first = b * FROZEN_BLOCK;
+      uint64_t bit = fz->starts[b];
+      for (i = first + 1; i < first + blocklen(fz, b); i++) {
+         setbits(fz->packed, bit, fz->widths[b], keys[i] - keys[i - 1]);
+         bit += fz->widths[b];
+      }
+   }
+}
+
+static void flatten(node * n, sortkey ** keys, uint64_t * len,
+                    uint64_t * cap) {
+   if (n == NULL || (!n->is2node && !n->is3node))
+      return;
+   flatten(n->left, keys, len, cap);
+   push(n->ldata, keys, len, cap);
+   flatten(n->middle, keys, len, cap);
+   if (n->is3node)
+      push(n->rdata, keys, len, cap);
+   flatten(n->right, keys, len, cap);
+}
+
+static void push(sortkey k, sortkey ** keys, uint64_t * len,
+                 uint64_t * cap) {
+   if (*len == *cap) {
+      *cap *= 2;
+      *keys = realloc(*keys, sizeof(sortkey) * *cap);
+   }
+   (*keys)[(*len)++] = k;
+}
+
+/*
+ * Halving the range with a select instead of an if/else compiles to a
+ * conditional move, so the search costs the same whatever the key.
+ */
+static uint64_t findblock(frozen * fz, sortkey k, bool strict) {
+   const sortkey * base = fz->heads;
+   uint64_t n = fz->nblocks;
+   while (n > 1) {
+      uint64_t half = n / 2;
+      bool right = strict ? base[half] < k : base[half] <= k;
+      base = right ? base + half : base;
+      n -= half;
+   }
+   return base - fz->heads;
+}
+
+static uint64_t blocklen(frozen * fz, uint64_t b) {
+   uint64_t left = fz->len - b * FROZEN_BLOCK;
+   return left < FROZEN_BLOCK ? left : FROZEN_BLOCK;
+}
+
+/*
+ * The high word is shifted in two steps so that a shift of 64 (bit on a
+ * word boundary) never happens.
+ */
+static uint64_t getbits(const uint64_t * words, uint64_t bit) {
+   uint64_t at = bit >> 6;
+   int off = bit & 63;
+   return (words[at] >> off) | ((words[at + 1] << 1) << (63 - off));
+}
+
+static void setbits(uint64_t * words, uint64_t bit, int width,
+                    uint64_t val) {
+   uint64_t at = bit >> 6;
+   int off = bit & 63;
+   words[at] |= val << off;
+   if (off + width > 64)
+      words[at + 1] |= val >> (64 - off);
+}
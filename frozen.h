@@ -0,0 +1,64 @@
+/*
+ * "frozen.h", by Sean Soderman
+ * Specification of frozen trees: compressed, read-only copies of a tree's
+ * keys, for data that has stopped changing.
+ */
+#ifndef FROZEN_H
+#define FROZEN_H
+
+#include "tree23.h"
+
+//Keys per compressed block.
+#ifndef FROZEN_BLOCK
+#define FROZEN_BLOCK 128
+#endif
+
+/*
+ * A 2-3 tree spends a whole node on every one or two keys. A frozen copy
+ * keeps just the keys, in order, cut into blocks of FROZEN_BLOCK. A block
+ * is stored as its first key (its frame of reference) followed by the
+ * gaps between consecutive keys, bit-packed at the width of the block's
+ * widest gap. Dense keys have small gaps, so most keys take a byte or less.
+ */
+typedef struct fz {
+   sortkey * heads;   //First key of every block.
+   uint64_t * starts; //Bit offset of every block's gaps in packed.
+   uint8_t * widths;  //Bits per gap in every block.
+   uint64_t * packed; //Every block's gaps, back to back.
+   uint64_t packed_len; //Words in packed, counting one of padding.
+   uint64_t nblocks;
+   uint64_t len;
+}frozen;
+
+//Words of packed a copy of len keys can need, whatever its gaps: every
+//gap at the widest 32 bits, plus a block's worth of slack and the padding.
+#define FROZEN_WORDS(len) ((len) / 2 + FROZEN_BLOCK / 2 + 2)
+
+//Makes a frozen copy of every value in the tree. Flushes the tree first.
+frozen * tree_freeze(tree * root);
+
+//Like tree_freeze, but writes into fz's arrays, which have room for max
+//keys: max / FROZEN_BLOCK + 1 blocks and FROZEN_WORDS(max) packed words.
+//Returns false, leaving fz as it was, if the tree holds more than max.
+bool freeze_into(tree * root, frozen * fz, uint64_t max);
+
+//Deletes a frozen copy.
+void delfrozen(frozen * fz);
+
+//Returns true if val is in the frozen copy. Finding the block and
+//scanning it are both done without data-dependent branches.
+bool frozen_contains(float val, frozen * fz);
+
+//Copies every value v with lo <= v <= hi (in key order) into out,
+//ascending, stopping after max values. Returns the number copied.
+uint64_t frozen_range(float lo, float hi, frozen * fz, float * out,
+                      uint64_t max);
+
+//Returns the number of bytes the frozen copy takes up.
+uint64_t frozen_bytes(frozen * fz);
+
+//Returns every key in the tree, in order, in a malloc'd array, storing
+//how many in *len. Flushes the tree first.
+sortkey * tree_keys(tree * root, uint64_t * len);
+
+#endif
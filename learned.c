@@ -0,0 +1,136 @@
+#include <math.h>
+#include <stdlib.h>
+#include "learned.h"
+/*
+ * "learned.c", by Sean Soderman
+ * A one-level piecewise-linear learned index over a tree's sorted keys.
+ * The model works on the integer keys the tree stores, so "distance
+ * between keys" is plain subtraction, NaNs and signed zeros included.
+ */
+
+//Slack added to LEARNED_EPS for rounding in the predicted position.
+#define SLACK (LEARNED_EPS + 1)
+
+//Returns the last segment whose first key is at most k. k must be at
+//least the first key of all.
+static uint64_t findseg(learned * li, sortkey k);
+//Returns the last position in [lo, hi] whose key is at most k, or lo if
+//there is none.
+static uint64_t findpos(learned * li, uint64_t lo, uint64_t hi, sortkey k);
+
+/*
+ * Each segment is grown for as long as some line through its first key
+ * keeps every key so far within LEARNED_EPS of its position. Every key
+ * narrows the range of slopes that would do, and once that range is empty
+ * the key starts the next segment. The line used is the middle of the
+ * range. One pass, and no key is looked at twice.
+ */
+learned * tree_learn(tree * root) {
+   learned * li = malloc(sizeof(learned));
+   uint64_t cap = 16;
+   uint64_t i = 0;
+   li->root = root;
+   li->keys = tree_keys(root, &li->len);
+   li->firsts = malloc(sizeof(sortkey) * cap);
+   li->starts = malloc(sizeof(uint64_t) * (cap + 1));
+   li->slopes = malloc(sizeof(double) * cap);
+   li->nsegs = 0;
+   li->fallbacks = 0;
+   while (i < li->len) {
+      uint64_t first = i;
+      double lo = 0;
+      double hi = INFINITY;
+      for (i = first + 1; i < li->len; i++) {
+         double dx = (double)li->keys[i] - (double)li->keys[first];
+         double dy = (double)(i - first);
+         //Copies of the first key all get predicted at its position.
+         if (dx == 0) {
+            if (dy > LEARNED_EPS)
+               break;
+            continue;
+         }
+         double low = (dy - LEARNED_EPS) / dx;
+         double high = (dy + LEARNED_EPS) / dx;
+         if (low > hi || high < lo)
+            break;
+         lo = low > lo ? low : lo;
+         hi = high < hi ? high : hi;
+      }
+      if (li->nsegs == cap) {
+         cap *= 2;
+         li->firsts = realloc(li->firsts, sizeof(sortkey) * cap);
+         li->starts = realloc(li->starts, sizeof(uint64_t) * (cap + 1));
+         li->slopes = realloc(li->slopes, sizeof(double) * cap);
+      }
+      li->firsts[li->nsegs] = li->keys[first];
+      li->starts[li->nsegs] = first;
+      li->slopes[li->nsegs] = hi == INFINITY ? 0 : (lo + hi) / 2;
+      li->nsegs++;
+   }
+   li->starts[li->nsegs] = li->len;
+   return li;
+}
+
+void dellearned(learned * li) {
+   free(li->keys);
+   free(li->firsts);
+   free(li->starts);
+   free(li->slopes);
+   free(li);
+}
+
+/*
+ * A key that is in the list is always inside its window, so if both ends
+ * of the window bracket k and k isn't between them, it isn't anywhere.
+ * Should the window ever fail to bracket k, the model was wrong about it
+ * and the tree gets the final say.
+ */
+bool learned_contains(float val, learned * li) {
+   sortkey k = tokey(val);
+   if (li->len == 0 || k < li->keys[0] || k > li->keys[li->len - 1]) {
+      li->fallbacks++;
+      return search(val, li->root->root);
+   }
+   uint64_t seg = findseg(li, k);
+   uint64_t start = li->starts[seg];
+   double guess = start + li->slopes[seg] * ((double)k - li->firsts[seg]);
+   double last = (double)(li->starts[seg + 1] - 1);
+   uint64_t pos = guess < start ? start :
+                  guess > last ? (uint64_t)last : (uint64_t)guess;
+   uint64_t lo = pos > SLACK ? pos - SLACK : 0;
+   uint64_t hi = pos + SLACK < li->len - 1 ? pos + SLACK : li->len - 1;
+   if (li->keys[lo] > k || li->keys[hi] < k) {
+      li->fallbacks++;
+      return search(val, li->root->root);
+   }
+   return li->keys[findpos(li, lo, hi, k)] == k;
+}
+
+uint64_t learned_bytes(learned * li) {
+   return sizeof(learned) + li->len * sizeof(sortkey) +
+          li->nsegs * (sizeof(sortkey) + sizeof(uint64_t) + sizeof(double)) +
+          sizeof(uint64_t);
+}
+
+//Both searches halve with a select, the way frozen.c's findblock does.
+static uint64_t findseg(learned * li, sortkey k) {
+   const sortkey * base = li->firsts;
+   uint64_t n = li->nsegs;
+   while (n > 1) {
+      uint64_t half = n / 2;
+      base = base[half] <= k ? base + half : base;
+      n -= half;
+   }
+   return base - li->firsts;
+}
+
+static uint64_t findpos(learned * li, uint64_t lo, uint64_t hi, sortkey k) {
+   const sortkey * base = li->keys + lo;
+   uint64_t n = hi - lo + 1;
+   while (n > 1) {
+      uint64_t half = n / 2;
+      base = base[half] <= k ? base + half : base;
+      n -= half;
+   }
+   return base - li->keys;
+}
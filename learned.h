@@ -0,0 +1,52 @@
+/*
+ * "learned.h", by Sean Soderman
+ * Specification of learned indexes: a piecewise-linear model of where each
+ * key sits in a finished tree's in-order key list, used to skip the
+ * root-to-leaf descent.
+ */
+#ifndef LEARNED_H
+#define LEARNED_H
+
+#include "frozen.h"
+
+//How far, in positions, a key may be from where the model predicts it.
+#ifndef LEARNED_EPS
+#define LEARNED_EPS 32
+#endif
+
+/*
+ * The keys are cut into segments, each with a line through its first key
+ * that predicts every key's position to within LEARNED_EPS. A lookup finds
+ * its segment, asks the line, and searches just that window of keys. The
+ * smoother the keys, the fewer segments: evenly spread keys need only a
+ * handful, however many there are.
+ */
+typedef struct li {
+   tree * root;      //Searched when the model can't vouch for a lookup.
+   sortkey * keys;   //Every key, in order.
+   uint64_t len;
+   sortkey * firsts; //First key of every segment.
+   uint64_t * starts; //Position of every segment's first key, and len.
+   double * slopes;  //Positions per key unit, for every segment.
+   uint64_t nsegs;
+   uint64_t fallbacks; //Lookups that were sent down the tree.
+}learned;
+
+//Fits a learned index to the tree's current keys. Flushes the tree
+//first. The tree must not change while the index is in use; build a new
+//one after it does.
+learned * tree_learn(tree * root);
+
+//Deletes a learned index. The tree it was built from is left alone.
+void dellearned(learned * li);
+
+//Returns true if val is in the tree. Keys outside the model's range, and
+//any lookup whose window turns out not to bracket the key, are answered
+//by descending the tree instead.
+bool learned_contains(float val, learned * li);
+
+//Returns the number of bytes the index takes up, counting its copy of
+//the keys.
+uint64_t learned_bytes(learned * li);
+
+#endif
@@ -1,9 +1,16 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "tree23.h"
+#include "treeio.h"
+#include "bench.h"
+#include "frozen.h"
 
 #ifndef DEFAULT_INSERTS
 #define DEFAULT_INSERTS 100000ULL
@@ -20,12 +27,69 @@
 //Runs a standard test of the program using 100,000 
 //randomised insertions and 50,000 deletions.
 void treetest(uint64_t num_to_insert, uint64_t num_to_delete, char * filename);
+//Loads every key in filename ("-" for stdin) into a fresh tree, then
+//writes the tree's contents back out, in order, to stdout.
+void ingesttest(char * filename, key_format fmt);
+//Ingests num_keys decimals that sit on or right next to the halfway point
+//between two floats, and checks every key against what strtof makes of it.
+void parsetest(uint64_t num_keys);
+//Orders keys for qsort.
+static int keycmp(const void * a, const void * b);
 
 int main(int argc, char * argv[]) {
-   if (argc < 3) {
+   if (argc >= 3 && strcmp(argv[1], "-i") == 0) {
+      key_format fmt = KEYS_TEXT;
+      if (argc >= 4 && strcmp(argv[3], "-b") == 0)
+         fmt = KEYS_BINARY;
+      ingesttest(argv[2], fmt);
+   }
+   else if (argc >= 3 && strcmp(argv[1], "-t") == 0)
+      parsetest((uint64_t)atoll(argv[2]));
+   else if (argc >= 4 && strcmp(argv[1], "-d") == 0)
+      deletebench((uint64_t)atoll(argv[2]), (uint64_t)atoll(argv[3]));
+   else if (argc >= 3 && strcmp(argv[1], "-s") == 0)
+      insertbench((uint64_t)atoll(argv[2]));
+   else if (argc >= 4 && strcmp(argv[1], "-q") == 0)
+      timerbench((uint64_t)atoll(argv[2]), (uint64_t)atoll(argv[3]));
+   else if (argc >= 3 && strcmp(argv[1], "-w") == 0)
+      bufferbench((uint64_t)atoll(argv[2]));
+   else if (argc >= 3 && strcmp(argv[1], "-n") == 0)
+      filterbench((uint64_t)atoll(argv[2]));
+   else if (argc >= 4 && strcmp(argv[1], "-p") == 0)
+      shardbench((uint64_t)atoll(argv[2]), atoi(argv[3]));
+   else if (argc >= 3 && strcmp(argv[1], "-z") == 0)
+      freezebench((uint64_t)atoll(argv[2]));
+   else if (argc >= 4 && strcmp(argv[1], "-m") == 0)
+      shmbench((uint64_t)atoll(argv[2]), atoi(argv[3]));
+   else if (argc >= 3 && strcmp(argv[1], "-l") == 0)
+      learnbench((uint64_t)atoll(argv[2]));
+   else if (argc >= 3 && strcmp(argv[1], "-v") == 0)
+      verifybench((uint64_t)atoll(argv[2]));
+   else if (argc >= 4 && strcmp(argv[1], "-a") == 0)
+      allocbench((uint64_t)atoll(argv[2]), atoi(argv[3]));
+   else if (argc >= 3 && strcmp(argv[1], "-g") == 0)
+      lazybench((uint64_t)atoll(argv[2]));
+   else if (argc < 3) {
       fprintf(stderr, "No options specified. Will run standard test.\n");
       fprintf(stderr, "Usage: %s [num_to_insert] [num_to_delete]" 
       " [filename]\n", argv[0]);
+      fprintf(stderr, "   or: %s -i [filename] [-b]\n", argv[0]);
+      fprintf(stderr, "   or: %s -t [num_keys]\n", argv[0]);
+      fprintf(stderr, "   or: %s -d [num_to_insert] [num_to_delete]\n",
+              argv[0]);
+      fprintf(stderr, "   or: %s -s [num_to_insert]\n", argv[0]);
+      fprintf(stderr, "   or: %s -q [num_timers] [num_ops]\n", argv[0]);
+      fprintf(stderr, "   or: %s -w [num_to_insert]\n", argv[0]);
+      fprintf(stderr, "   or: %s -n [num_to_insert]\n", argv[0]);
+      fprintf(stderr, "   or: %s -p [num_to_insert] [num_threads]\n",
+              argv[0]);
+      fprintf(stderr, "   or: %s -z [num_to_insert]\n", argv[0]);
+      fprintf(stderr, "   or: %s -m [num_to_insert] [num_readers]\n",
+              argv[0]);
+      fprintf(stderr, "   or: %s -l [num_to_insert]\n", argv[0]);
+      fprintf(stderr, "   or: %s -v [num_to_insert]\n", argv[0]);
+      fprintf(stderr, "   or: %s -a [num_ops] [num_threads]\n", argv[0]);
+      fprintf(stderr, "   or: %s -g [num_to_insert]\n", argv[0]);
       treetest(DEFAULT_INSERTS, DEFAULT_DELETES, NULL);
    }
    else {
@@ -45,7 +109,8 @@ void nodecheck(node * n) {
    char * arr[] = {"false", "true"};
    fprintf(stderr, debug_msg,
                     n->left, n->middle, n->mid_right, n->right, n->parent,
-                    n->ldata, n->mdata, n->rdata, arr[n->is2node],
+                    fromkey(n->ldata), fromkey(n->mdata), fromkey(n->rdata),
+                    arr[n->is2node],
                     arr[n->is3node], arr[n->is4node]);
 }
 //Runs a tree test of the program using a user-specified
@@ -97,3 +162,87 @@ void treetest(uint64_t num_to_insert, uint64_t num_to_delete, char * filename) {
    deltree(t);
    free(test_array);
 }
+
+//Ingests a key file (text unless -b was given) and dumps the result.
+void ingesttest(char * filename, key_format fmt) {
+   int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO :
+                                         open(filename, O_RDONLY);
+   if (fd < 0) {
+      perror(filename);
+      exit(1);
+   }
+   tree * t = create();
+   clock_t start_time = clock();
+   int64_t num_read = tree_ingest(t, fd, fmt);
+   clock_t end_time = clock();
+   if (num_read < 0) {
+      perror(filename);
+      exit(1);
+   }
+   if (fd != STDIN_FILENO)
+      close(fd);
+   printf("Ingested %lli keys. Runtime in clock ticks: %li, seconds: %f\n",
+          (long long)num_read, (end_time - start_time),
+          (float)(end_time - start_time) / CLOCKS_PER_SEC);
+   printf("**Tree contents incoming**\n");
+   fflush(stdout);
+   if (!tree_export(t->root, STDOUT_FILENO, KEYS_TEXT))
+      perror("stdout");
+   deltree(t);
+}
+
+/*
+ * Each key starts from the exact halfway point between a random float in
+ * [1, 65536) and the next one up, or the double on either side of it,
+ * printed with 17 significant digits. Those are the inputs where rounding
+ * to double first and then to float can go wrong.
+ */
+void parsetest(uint64_t num_keys) {
+   char path[] = "/tmp/parsetestXXXXXX";
+   int fd = mkstemp(path);
+   if (fd < 0) {
+      perror(path);
+      exit(1);
+   }
+   FILE * out = fdopen(fd, "w+");
+   sortkey * want = malloc(sizeof(sortkey) * (num_keys + 1));
+   char text[64];
+   uint64_t i = 0;
+   uint64_t wrong = 0;
+   srand(time(NULL));
+   for (i = 0; i < num_keys; i++) {
+      float f = ldexpf(1.0f + (float)rand() / RAND_MAX, rand() % 16);
+      double mid = ((double)f + nextafterf(f, INFINITY)) / 2;
+      if (i % 3 == 1)
+         mid = nextafter(mid, 0);
+      else if (i % 3 == 2)
+         mid = nextafter(mid, INFINITY);
+      snprintf(text, sizeof(text), "%.17g", mid);
+      fprintf(out, "%s\n", text);
+      want[i] = tokey(strtof(text, NULL));
+   }
+   fflush(out);
+   lseek(fd, 0, SEEK_SET);
+   tree * t = create();
+   int64_t num_read = tree_ingest(t, fd, KEYS_TEXT);
+   uint64_t len = 0;
+   sortkey * got = tree_keys(t, &len);
+   qsort(want, num_keys, sizeof(sortkey), keycmp);
+   for (i = 0; i < num_keys && i < len; i++)
+      wrong += got[i] != want[i];
+   printf("Ingested %lli of %llu near-halfway keys, %llu differ from "
+          "strtof\n", (long long)num_read, (unsigned long long)num_keys,
+          (unsigned long long)(wrong + (len > num_keys ? len - num_keys :
+                                                          num_keys - len)));
+   fclose(out);
+   unlink(path);
+   deltree(t);
+   free(got);
+   free(want);
+}
+
+static int keycmp(const void * a, const void * b) {
+   sortkey x = *(const sortkey *)a;
+   sortkey y = *(const sortkey *)b;
+   return (x > y) - (x < y);
+}
@@ -0,0 +1,157 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nodepool.h"
+/*
+ * "nodepool.c", by Sean Soderman
+ * Per-thread node caches over a shared pool of slabs. A free node's own
+ * fields hold the lists it is on: left links the nodes of a cache or
+ * batch, and a batch's first node keeps the batch's length in ldata and
+ * the next batch in the shared stack in parent.
+ */
+
+/*
+ * One thread's free nodes.
+ */
+typedef struct nc {
+   node * head;
+   uint64_t len;
+   bool registered; //Set once the thread exit hook knows about it.
+}cache;
+
+static _Thread_local cache mine = {NULL, 0, false};
+
+//Full batches handed back by threads, newest first. Pushed without the
+//lock; popped only with it held, so a popped batch can't be popped again
+//and pushed back between reading it and unlinking it.
+static _Atomic(node *) batches = NULL;
+//Guards everything below, and popping from batches.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static node * slab = NULL;
+static uint64_t slab_len = 0;
+static uint64_t slab_ndx = 0;
+//Every slab, so they stay reachable for as long as the process runs.
+static node ** slabs = NULL;
+static uint64_t slabs_len = 0;
+static uint64_t slabs_ndx = 0;
+static _Atomic uint64_t reserved = 0;
+//Hands a thread's cache back when the thread exits.
+static pthread_key_t leaving;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+//Fills this thread's empty cache with a batch, from the stack of batches
+//if there is one or from a slab if not.
+static void refill();
+//Hands the first len nodes of this thread's cache back as one batch.
+static void drain(uint64_t len);
+//Pushes the chain of len nodes starting at first onto the batch stack.
+static void push(node * first, uint64_t len);
+//Makes sure this thread's cache is handed back when the thread exits.
+static void enroll();
+//Creates the thread exit hook. Run once.
+static void makekey();
+//The thread exit hook: hands back whatever is left in the cache.
+static void leave(void * arg);
+
+node * nodepool_get() {
+   if (mine.head == NULL)
+      refill();
+   node * n = mine.head;
+   mine.head = n->left;
+   mine.len--;
+   memset(n, '\0', sizeof(node));
+   return n;
+}
+
+void nodepool_put(node * n) {
+   n->left = mine.head;
+   mine.head = n;
+   if (++mine.len >= 2 * POOL_BATCH)
+      drain(POOL_BATCH);
+   enroll();
+}
+
+uint64_t nodepool_reserved() {
+   return atomic_load(&reserved);
+}
+
+/*
+ * Slabs start at 8192 nodes and double, the same as a tree's own slabs.
+ */
+static void refill() {
+   uint64_t i = 0;
+   pthread_mutex_lock(&lock);
+   node * top = atomic_load(&batches);
+   while (top != NULL &&
+          !atomic_compare_exchange_weak(&batches, &top, top->parent))
+      ;
+   if (top != NULL) {
+      mine.head = top;
+      mine.len = top->ldata;
+   }
+   else {
+      if (slab == NULL || slab_ndx + POOL_BATCH > slab_len) {
+         slab_len = slab_len == 0 ? 8192 : slab_len * 2;
+         slab = malloc(sizeof(node) * slab_len);
+         slab_ndx = 0;
+         if (slabs_ndx == slabs_len) {
+            slabs_len = slabs_len == 0 ? 64 : slabs_len * 2;
+            slabs = realloc(slabs, sizeof(node *) * slabs_len);
+         }
+         slabs[slabs_ndx++] = slab;
+      }
+      for (i = 0; i < POOL_BATCH; i++)
+         slab[slab_ndx + i].left = i + 1 < POOL_BATCH ?
+                                   slab + slab_ndx + i + 1 : NULL;
+      mine.head = slab + slab_ndx;
+      mine.len = POOL_BATCH;
+      slab_ndx += POOL_BATCH;
+      atomic_fetch_add(&reserved, POOL_BATCH);
+   }
+   pthread_mutex_unlock(&lock);
+   enroll();
+}
+
+static void drain(uint64_t len) {
+   node * first = mine.head;
+   node * last = first;
+   uint64_t i = 0;
+   for (i = 1; i < len; i++)
+      last = last->left;
+   mine.head = last->left;
+   mine.len -= len;
+   last->left = NULL;
+   push(first, len);
+}
+
+static void push(node * first, uint64_t len) {
+   node * top = atomic_load(&batches);
+   first->ldata = (sortkey)len;
+   do {
+      first->parent = top;
+   } while (!atomic_compare_exchange_weak(&batches, &top, first));
+}
+
+static void enroll() {
+   if (mine.registered)
+      return;
+   pthread_once(&once, makekey);
+   pthread_setspecific(leaving, &mine);
+   mine.registered = true;
+}
+
+static void makekey() {
+   pthread_key_create(&leaving, leave);
+}
+
+/*
+ * The batch may be short, which is why batches carry their own length.
+ */
+static void leave(void * arg) {
+   cache * c = arg;
+   if (c->head != NULL)
+      push(c->head, c->len);
+   c->head = NULL;
+   c->len = 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * "nodepool.h", by Sean Soderman
+ * Specification of the shared node pool: one process-wide supply of
+ * nodes, handed out through a cache kept by each thread.
+ */
+#ifndef NODEPOOL_H
+#define NODEPOOL_H
+
+#include "tree23.h"
+
+//Nodes moved between a thread's cache and the shared pool at a time.
+#ifndef POOL_BATCH
+#define POOL_BATCH 64
+#endif
+
+/*
+ * A thread takes nodes from and gives them back to its own cache, with no
+ * locking at all. A cache that runs dry takes a whole batch from the
+ * shared pool; one that holds two batches' worth hands a batch back. So a
+ * thread that frees more nodes than it allocates feeds the ones that
+ * allocate more, a batch at a time. Batches are handed back lock-free;
+ * only taking one, or carving a fresh one from a slab, takes the lock.
+ */
+
+//Returns a zeroed node from this thread's cache.
+node * nodepool_get();
+
+//Puts n in this thread's cache, for whichever thread needs it next.
+void nodepool_put(node * n);
+
+//Returns the number of nodes the pool has ever carved out of its slabs.
+//Slabs are never given back to the system.
+uint64_t nodepool_reserved();
+
+#endif
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shard.h"
+/*
+ * "shard.c", by Sean Soderman
+ * A front end that spreads keys over several independent trees by range.
+ * The trees draw their nodes from the shared node pool, whose per-thread
+ * caches keep them off each other's locks, so a shard's lock is all that
+ * has to be held to write to it, and writers in different ranges run side
+ * by side.
+ */
+
+/*
+ * One shard's part of a batch, handed to the thread that inserts it.
+ */
+typedef struct w {
+   sharded * s;
+   int shard;
+   float * vals;
+   uint64_t len;
+   bool full; //Set if the shard outgrew the limit.
+}work;
+
+//Returns the index of the shard whose range holds k.
+static int route(sharded * s, sortkey k);
+//Copies the values with keys in [lo, hi] in the subtree n into out, in
+//order, until *len reaches max.
+static void gather(node * n, sortkey lo, sortkey hi, float * out,
+                   uint64_t * len, uint64_t max);
+//Inserts one shard's part of a batch. Runs in its own thread.
+static void * batchworker(void * arg);
+//Takes the layout lock exclusively and rebalances, unless force is clear
+//and another thread already rebalanced while this one waited.
+static void rebalance(sharded * s, bool force);
+//Pulls every key out of the shards and bulk loads equal shares back in.
+//The layout lock must be held exclusively.
+static void redistribute(sharded * s);
+
+sharded * create_sharded(int nshards) {
+   sharded * s = malloc(sizeof(sharded));
+   int i = 0;
+   if (nshards < 1)
+      nshards = 1;
+   s->nshards = nshards;
+   s->shards = malloc(sizeof(tree *) * nshards);
+   s->locks = malloc(sizeof(pthread_mutex_t) * nshards);
+   s->bounds = malloc(sizeof(sortkey) * nshards);
+   s->counts = calloc(nshards, sizeof(uint64_t));
+   s->limit = SHARD_MIN_KEYS;
+   pthread_rwlock_init(&s->layout, NULL);
+   for (i = 0; i < nshards; i++) {
+      s->shards[i] = create_pooled();
+      pthread_mutex_init(&s->locks[i], NULL);
+      s->bounds[i] = UINT32_MAX;
+   }
+   return s;
+}
+
+void delsharded(sharded * s) {
+   int i = 0;
+   for (i = 0; i < s->nshards; i++) {
+      deltree(s->shards[i]);
+      pthread_mutex_destroy(&s->locks[i]);
+   }
+   pthread_rwlock_destroy(&s->layout);
+   free(s->shards);
+   free(s->locks);
+   free(s->bounds);
+   free(s->counts);
+   free(s);
+}
+
+void sharded_insert(float val, sharded * s) {
+   bool full = false;
+   pthread_rwlock_rdlock(&s->layout);
+   int i = route(s, tokey(val));
+   pthread_mutex_lock(&s->locks[i]);
+   insert(val, s->shards[i]);
+   full = ++s->counts[i] > s->limit;
+   pthread_mutex_unlock(&s->locks[i]);
+   pthread_rwlock_unlock(&s->layout);
+   if (full)
+      rebalance(s, false);
+}
+
+/*
+ * rmval doesn't say whether it found anything, so the shard is searched
+ * first to keep its count exact.
+ */
+void sharded_rmval(float val, sharded * s) {
+   pthread_rwlock_rdlock(&s->layout);
+   int i = route(s, tokey(val));
+   pthread_mutex_lock(&s->locks[i]);
+   if (contains(val, s->shards[i])) {
+      rmval(val, s->shards[i]);
+      s->counts[i]--;
+   }
+   pthread_mutex_unlock(&s->locks[i]);
+   pthread_rwlock_unlock(&s->layout);
+}
+
+bool sharded_contains(float val, sharded * s) {
+   bool found = false;
+   pthread_rwlock_rdlock(&s->layout);
+   int i = route(s, tokey(val));
+   pthread_mutex_lock(&s->locks[i]);
+   found = contains(val, s->shards[i]);
+   pthread_mutex_unlock(&s->locks[i]);
+   pthread_rwlock_unlock(&s->layout);
+   return found;
+}
+
+/*
+ * A counting sort by shard puts each shard's keys next to each other, then
+ * every non-empty shard gets a thread that sorts and inserts its part.
+ */
+void sharded_insert_batch(float * vals, uint64_t len, sharded * s) {
+   int n = s->nshards;
+   uint64_t * next = calloc(n + 1, sizeof(uint64_t));
+   int * dest = malloc(sizeof(int) * (len + 1));
+   float * parts = malloc(sizeof(float) * (len + 1));
+   pthread_t * threads = malloc(sizeof(pthread_t) * n);
+   bool * started = calloc(n, sizeof(bool));
+   work * jobs = malloc(sizeof(work) * n);
+   bool full = false;
+   uint64_t i = 0;
+   int j = 0;
+   pthread_rwlock_rdlock(&s->layout);
+   for (i = 0; i < len; i++) {
+      dest[i] = route(s, tokey(vals[i]));
+      next[dest[i] + 1]++;
+   }
+   for (j = 0; j < n; j++)
+      next[j + 1] += next[j];
+   for (j = 0; j < n; j++) {
+      jobs[j].s = s;
+      jobs[j].shard = j;
+      jobs[j].vals = parts + next[j];
+      jobs[j].len = next[j + 1] - next[j];
+      jobs[j].full = false;
+   }
+   for (i = 0; i < len; i++)
+      parts[next[dest[i]]++] = vals[i];
+   for (j = 0; j < n; j++) {
+      if (jobs[j].len == 0)
+         continue;
+      //If no thread can be had, do the work right here.
+      started[j] = pthread_create(&threads[j], NULL, batchworker,
+                                  &jobs[j]) == 0;
+      if (!started[j])
+         (void)batchworker(&jobs[j]);
+   }
+   for (j = 0; j < n; j++) {
+      if (started[j])
+         pthread_join(threads[j], NULL);
+      full = full || jobs[j].full;
+   }
+   pthread_rwlock_unlock(&s->layout);
+   if (full)
+      rebalance(s, false);
+   free(next);
+   free(dest);
+   free(parts);
+   free(threads);
+   free(started);
+   free(jobs);
+}
+
+/*
+ * The shards in the range are locked in ascending order, the same order
+ * every caller uses, so two scans can never deadlock.
+ */
+uint64_t sharded_range(float lo, float hi, sharded * s, float * out,
+                       uint64_t max) {
+   uint64_t len = 0;
+   int i = 0;
+   sortkey from = tokey(lo);
+   sortkey to = tokey(hi);
+   if (to < from)
+      return 0;
+   pthread_rwlock_rdlock(&s->layout);
+   int first = route(s, from);
+   int last = route(s, to);
+   for (i = first; i <= last; i++)
+      pthread_mutex_lock(&s->locks[i]);
+   for (i = first; i <= last; i++)
+      gather(s->shards[i]->root, from, to, out, &len, max);
+   for (i = first; i <= last; i++)
+      pthread_mutex_unlock(&s->locks[i]);
+   pthread_rwlock_unlock(&s->layout);
+   return len;
+}
+
+void sharded_rebalance(sharded * s) {
+   rebalance(s, true);
+}
+
+/*
+ * Binary search for the first bound above k. Keys equal to a bound
+ * belong to the shard above it.
+ */
+static int route(sharded * s, sortkey k) {
+   int lo = 0;
+   int hi = s->nshards - 1;
+   while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (k < s->bounds[mid])
+         hi = mid;
+      else
+         lo = mid + 1;
+   }
+   return lo;
+}
+
+/*
+ * Equal keys can sit on either side of a separator after deletions, so
+ * every comparison here is inclusive.
+ */
+static void gather(node * n, sortkey lo, sortkey hi, float * out,
+                   uint64_t * len, uint64_t max) {
+   if (n == NULL || *len == max || !(n->is2node || n->is3node))
+      return;
+   if (lo <= n->ldata)
+      gather(n->left, lo, hi, out, len, max);
+   if (*len < max && lo <= n->ldata && n->ldata <= hi)
+      out[(*len)++] = fromkey(n->ldata);
+   if (n->is3node) {
+      if (lo <= n->rdata && n->ldata <= hi)
+         gather(n->middle, lo, hi, out, len, max);
+      if (*len < max && lo <= n->rdata && n->rdata <= hi)
+         out[(*len)++] = fromkey(n->rdata);
+      if (n->rdata <= hi)
+         gather(n->right, lo, hi, out, len, max);
+   }
+   else if (n->ldata <= hi)
+      gather(n->right, lo, hi, out, len, max);
+}
+
+static void * batchworker(void * arg) {
+   work * job = arg;
+   sharded * s = job->s;
+   pthread_mutex_lock(&s->locks[job->shard]);
+   insert_batch(job->vals, job->len, s->shards[job->shard]);
+   s->counts[job->shard] += job->len;
+   job->full = s->counts[job->shard] > s->limit;
+   pthread_mutex_unlock(&s->locks[job->shard]);
+   return NULL;
+}
+
+static void rebalance(sharded * s, bool force) {
+   int i = 0;
+   pthread_rwlock_wrlock(&s->layout);
+   for (i = 0; i < s->nshards && !force; i++)
+      force = s->counts[i] > s->limit;
+   if (force)
+      redistribute(s);
+   pthread_rwlock_unlock(&s->layout);
+}
+
+/*
+ * The shards cover ascending ranges, so reading them out one after the
+ * other yields every key in order, ready to be cut into equal runs and
+ * bulk loaded. A run's end is pulled back to the first copy of its last
+ * key, so that equal keys never straddle two shards. The new limit is
+ * twice the fair share: uniform growth rebalances only after the tree
+ * doubles, while a skewed stream of keys gets spread out again.
+ */
+static void redistribute(sharded * s) {
+   uint64_t total = 0;
+   uint64_t len = 0;
+   uint64_t start = 0;
+   int i = 0;
+   for (i = 0; i < s->nshards; i++)
+      total += s->counts[i];
+   float * keys = malloc(sizeof(float) * (total + 1));
+   for (i = 0; i < s->nshards; i++) {
+      gather(s->shards[i]->root, 0, UINT32_MAX, keys, &len, total);
+      deltree(s->shards[i]);
+   }
+   for (i = 0; i < s->nshards; i++) {
+      uint64_t end = len;
+      if (i < s->nshards - 1) {
+         end = len * (i + 1) / s->nshards;
+         if (end < start)
+            end = start;
+         while (end > start && tokey(keys[end - 1]) == tokey(keys[end]))
+            end--;
+         s->bounds[i] = end < len ? tokey(keys[end]) : UINT32_MAX;
+      }
+      s->shards[i] = create_pooled();
+      bulkload(keys + start, end - start, s->shards[i]);
+      s->counts[i] = end - start;
+      start = end;
+   }
+   s->limit = 2 * len / s->nshards;
+   if (s->limit < SHARD_MIN_KEYS)
+      s->limit = SHARD_MIN_KEYS;
+   free(keys);
+}
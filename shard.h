@@ -0,0 +1,72 @@
+/*
+ * "shard.h", by Sean Soderman
+ * Specification of a sharded tree: several 2-3 trees that split the key
+ * space into ranges, so that writes to different ranges never wait on
+ * each other.
+ */
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <pthread.h>
+#include "tree23.h"
+
+//A shard never triggers a rebalance before it holds this many keys.
+#ifndef SHARD_MIN_KEYS
+#define SHARD_MIN_KEYS (1 << 14)
+#endif
+
+/*
+ * Shard i holds every key v with bounds[i - 1] <= v < bounds[i], where
+ * the bounds below shard 0 and above the last shard are open. Bounds are
+ * compared in the trees' own key order, so NaNs and -0 route consistently.
+ * Every shard is a tree of its own, with its own lock, and takes its nodes
+ * from the shared node pool.
+ */
+typedef struct sh {
+   tree ** shards;
+   pthread_mutex_t * locks;
+   //The nshards - 1 boundaries between neighbouring shards, ascending.
+   sortkey * bounds;
+   //Keys in each shard. Only changed under that shard's lock.
+   uint64_t * counts;
+   int nshards;
+   //Once any shard holds more keys than this, the shards are rebalanced.
+   uint64_t limit;
+   //Held shared by every operation, and exclusively while a rebalance
+   //moves the bounds and rebuilds the shards.
+   pthread_rwlock_t layout;
+}sharded;
+
+//Creates nshards empty shards. Until the first rebalance every key goes
+//to shard 0, since there are no keys yet to pick the bounds from.
+sharded * create_sharded(int nshards);
+
+//Deletes every shard and the sharded struct itself.
+void delsharded(sharded * s);
+
+//Inserts val into the shard whose range holds it. Thread safe.
+void sharded_insert(float val, sharded * s);
+
+//Removes one copy of val, if there is one. Thread safe.
+void sharded_rmval(float val, sharded * s);
+
+//Returns true if val is stored in any shard. Thread safe.
+bool sharded_contains(float val, sharded * s);
+
+//Splits vals up by shard, then inserts each shard's part in a thread of
+//its own. Thread safe.
+void sharded_insert_batch(float * vals, uint64_t len, sharded * s);
+
+//Copies every value v with lo <= v <= hi into out, ascending, stopping
+//after max values. All shards in the range are locked at once, so the
+//result is a consistent view even across shard boundaries.
+//Returns the number of values copied.
+uint64_t sharded_range(float lo, float hi, sharded * s, float * out,
+                       uint64_t max);
+
+//Redraws the bounds so every shard holds the same number of keys, and
+//rebuilds the shards from scratch. Inserts do this on their own once a
+//shard grows past twice its fair share.
+void sharded_rebalance(sharded * s);
+
+#endif
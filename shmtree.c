@@ -0,0 +1,509 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "shmtree.h"
+/*
+ * "shmtree.c", by Sean Soderman
+ * A 2-3 tree kept entirely in a shared-memory segment. Nodes come from an
+ * arena in the segment and link to each other by node number instead of
+ * by pointer. The one writer changes them in place between two bumps of a
+ * sequence number, and readers search again if a write overtook them.
+ */
+
+//Marks a segment as a shared tree: "tree23sn".
+#define SHM_MAGIC 0x6e73333265657274ULL
+
+/*
+ * A node of the shared tree. Links are node numbers in the arena, and 0
+ * is no node, so a leaf's kids are all 0. keys[0, count) are in use, and
+ * an inner node has count + 1 kids. Unlike the private node there are no
+ * parent links: the writer remembers the path it came down instead, which
+ * leaves fewer links for a racing reader to find half written.
+ */
+typedef struct sn {
+   uint32_t kids[3];
+   sortkey keys[2];
+   int count;
+}shmnode;
+
+/*
+ * The start of the segment. The node arena follows it.
+ */
+typedef struct sg {
+   uint64_t magic;
+   uint64_t capacity; //Keys the tree may hold. The arena has as many nodes.
+   uint64_t size;
+   uint64_t arena;    //Bytes from the start of the segment to node 0.
+   //Odd while the writer is changing the tree. Everything below is only
+   //written while it is odd.
+   _Atomic uint64_t seq;
+   uint64_t len;
+   uint32_t root;     //0 while the tree is empty.
+   uint32_t unused;   //Nodes past this one have never been handed out.
+   uint32_t free;     //Freed nodes, linked through kids[0].
+}segment;
+
+//Returns the size of a segment with room for capacity keys, and stores
+//where its arena starts in *arena.
+static uint64_t place(uint64_t capacity, uint64_t * arena);
+//Returns node k of seg's arena.
+static shmnode * at(segment * seg, uint32_t k);
+//Hands out a cleared node, from the free list if it has any.
+static uint32_t grab(segment * seg);
+//Puts node k on the free list.
+static void release(segment * seg, uint32_t k);
+//Marks the start and the end of a write, for readers to notice.
+static void writing(segment * seg);
+static void written(segment * seg);
+//Waits until no write is under way, and returns the sequence number.
+static uint64_t begin(shmtree * sh);
+//Returns true if no write has started since begin returned seq. Counts a
+//retry if one has.
+static bool end(shmtree * sh, uint64_t seq);
+//Copies node k for a reader, or returns false if k isn't a node a valid
+//tree could link to. The copy's count is cut down to between 0 and 2.
+static bool peek(segment * seg, uint32_t k, shmnode * out);
+//Copies the values in [lo, hi] in the subtree k into out, in order, until
+//*len reaches max or *budget nodes have been looked at.
+static void collect(segment * seg, uint32_t k, sortkey lo, sortkey hi,
+                    int depth, uint64_t * budget, float * out,
+                    uint64_t * len, uint64_t max);
+
+shmtree * create_shmtree(const char * name, uint64_t capacity) {
+   uint64_t arena = 0;
+   if (capacity >= UINT32_MAX) {
+      errno = EINVAL;
+      return NULL;
+   }
+   uint64_t size = place(capacity, &arena);
+   int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0)
+      return NULL;
+   if (ftruncate(fd, size) < 0) {
+      int err = errno;
+      close(fd);
+      shm_unlink(name);
+      errno = err;
+      return NULL;
+   }
+   segment * seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, 0);
+   close(fd);
+   if (seg == MAP_FAILED) {
+      int err = errno;
+      shm_unlink(name);
+      errno = err;
+      return NULL;
+   }
+   //ftruncate zeroed everything, so the tree starts out empty. Node 0
+   //stands for no node and is never handed out.
+   seg->capacity = capacity;
+   seg->size = size;
+   seg->arena = arena;
+   seg->unused = 1;
+   seg->magic = SHM_MAGIC;
+   shmtree * sh = malloc(sizeof(shmtree));
+   sh->seg = seg;
+   sh->size = size;
+   sh->name = strdup(name);
+   sh->retries = 0;
+   return sh;
+}
+
+/*
+ * The header is checked against the layout this build would have made
+ * for the same capacity, so every node a reader can reach is inside the
+ * mapping.
+ */
+shmtree * open_shmtree(const char * name) {
+   struct stat st;
+   uint64_t arena = 0;
+   int fd = shm_open(name, O_RDONLY, 0);
+   if (fd < 0)
+      return NULL;
+   if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < sizeof(segment)) {
+      close(fd);
+      errno = EINVAL;
+      return NULL;
+   }
+   segment * seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (seg == MAP_FAILED)
+      return NULL;
+   if (seg->magic != SHM_MAGIC || seg->size != (uint64_t)st.st_size ||
+       seg->capacity >= UINT32_MAX ||
+       place(seg->capacity, &arena) != seg->size || arena != seg->arena) {
+      munmap(seg, st.st_size);
+      errno = EINVAL;
+      return NULL;
+   }
+   shmtree * sh = malloc(sizeof(shmtree));
+   sh->seg = seg;
+   sh->size = st.st_size;
+   sh->name = NULL;
+   sh->retries = 0;
+   return sh;
+}
+
+void delshmtree(shmtree * sh) {
+   munmap(sh->seg, sh->size);
+   if (sh->name != NULL) {
+      shm_unlink(sh->name);
+      free(sh->name);
+   }
+   free(sh);
+}
+
+/*
+ * Every node holds at least one key, so a tree of capacity keys never
+ * needs more than capacity nodes, and checking the key count up front
+ * means grab can't run dry halfway through the splits. The descent and
+ * the splits on the way back up are the private tree's, on node numbers.
+ */
+bool shmtree_insert(float val, shmtree * sh) {
+   segment * seg = sh->seg;
+   sortkey key = tokey(val);
+   uint32_t path[SHM_MAX_HEIGHT + 1];
+   int via[SHM_MAX_HEIGHT + 1];
+   int depth = 0;
+   int i = 0;
+   if (sh->name == NULL || seg->len == seg->capacity)
+      return false;
+   writing(seg);
+   seg->len++;
+   if (seg->root == 0) {
+      seg->root = grab(seg);
+      at(seg, seg->root)->keys[0] = key;
+      at(seg, seg->root)->count = 1;
+      written(seg);
+      return true;
+   }
+   uint32_t k = seg->root;
+   for (;;) {
+      shmnode * n = at(seg, k);
+      for (i = 0; i < n->count && n->keys[i] <= key; i++)
+         ;
+      path[depth] = k;
+      via[depth++] = i;
+      if (n->kids[0] == 0)
+         break;
+      k = n->kids[i];
+   }
+   //up goes into the node at the end of the path, with right as its
+   //right-hand child. A full node splits and sends its middle key up.
+   sortkey up = key;
+   uint32_t right = 0;
+   while (depth > 0) {
+      shmnode * n = at(seg, path[--depth]);
+      sortkey keys[3];
+      uint32_t kids[4];
+      int at_key = via[depth];
+      for (i = 0; i < n->count; i++)
+         keys[i + (i >= at_key)] = n->keys[i];
+      keys[at_key] = up;
+      for (i = 0; i <= n->count; i++)
+         kids[i + (i > at_key)] = n->kids[i];
+      kids[at_key + 1] = right;
+      if (n->count == 1) {
+         memcpy(n->keys, keys, sizeof(n->keys));
+         memcpy(n->kids, kids, sizeof(n->kids));
+         n->count = 2;
+         written(seg);
+         return true;
+      }
+      right = grab(seg);
+      shmnode * sib = at(seg, right);
+      sib->keys[0] = keys[2];
+      sib->kids[0] = kids[2];
+      sib->kids[1] = kids[3];
+      sib->count = 1;
+      n->keys[0] = keys[0];
+      n->kids[0] = kids[0];
+      n->kids[1] = kids[1];
+      n->kids[2] = 0;
+      n->count = 1;
+      up = keys[1];
+   }
+   //The root split: grow a new one above it.
+   uint32_t top = grab(seg);
+   at(seg, top)->keys[0] = up;
+   at(seg, top)->kids[0] = seg->root;
+   at(seg, top)->kids[1] = right;
+   at(seg, top)->count = 1;
+   seg->root = top;
+   written(seg);
+   return true;
+}
+
+/*
+ * The value is found before anything is written, so a miss costs readers
+ * nothing. An inner node's copy is swapped for its predecessor, the
+ * largest key in the leaf at the bottom of its left subtree, so the key
+ * always comes out of a leaf. Then, the same as the private tree's
+ * repair: an emptied node takes a key from a neighbour that has two, or
+ * else is merged into its neighbour, which can empty the parent in turn.
+ */
+bool shmtree_rmval(float val, shmtree * sh) {
+   segment * seg = sh->seg;
+   sortkey key = tokey(val);
+   uint32_t path[SHM_MAX_HEIGHT + 1];
+   int via[SHM_MAX_HEIGHT + 1];
+   int depth = 0;
+   int i = 0;
+   shmnode * found = NULL;
+   int slot = 0;
+   uint32_t k = seg->root;
+   if (sh->name == NULL)
+      return false;
+   while (k != 0) {
+      shmnode * n = at(seg, k);
+      i = n->count;
+      if (found != NULL)
+         ; //Keep right, down to the predecessor.
+      else {
+         for (i = 0; i < n->count && n->keys[i] < key; i++)
+            ;
+         if (i < n->count && n->keys[i] == key) {
+            found = n;
+            slot = i;
+         }
+      }
+      path[depth] = k;
+      via[depth++] = i;
+      k = n->kids[i];
+   }
+   if (found == NULL)
+      return false;
+   writing(seg);
+   seg->len--;
+   shmnode * leaf = at(seg, path[depth - 1]);
+   if (leaf == found)
+      for (i = slot; i + 1 < leaf->count; i++)
+         leaf->keys[i] = leaf->keys[i + 1];
+   else
+      found->keys[slot] = leaf->keys[leaf->count - 1];
+   leaf->count--;
+   uint32_t orphan = 0; //The lone child of an emptied inner node.
+   int d = depth - 1;
+   while (at(seg, path[d])->count == 0) {
+      shmnode * n = at(seg, path[d]);
+      if (d == 0) {
+         seg->root = orphan;
+         release(seg, path[0]);
+         break;
+      }
+      shmnode * p = at(seg, path[d - 1]);
+      int c = via[d - 1];
+      shmnode * left = c > 0 ? at(seg, p->kids[c - 1]) : NULL;
+      shmnode * right = c < p->count ? at(seg, p->kids[c + 1]) : NULL;
+      if (left != NULL && left->count == 2) {
+         n->keys[0] = p->keys[c - 1];
+         n->kids[0] = left->kids[2];
+         n->kids[1] = orphan;
+         n->count = 1;
+         p->keys[c - 1] = left->keys[1];
+         left->kids[2] = 0;
+         left->count = 1;
+         break;
+      }
+      if (right != NULL && right->count == 2) {
+         n->keys[0] = p->keys[c];
+         n->kids[0] = orphan;
+         n->kids[1] = right->kids[0];
+         n->count = 1;
+         p->keys[c] = right->keys[0];
+         right->keys[0] = right->keys[1];
+         right->kids[0] = right->kids[1];
+         right->kids[1] = right->kids[2];
+         right->kids[2] = 0;
+         right->count = 1;
+         break;
+      }
+      //Both neighbours have one key: fold n into one of them, along with
+      //the separator between them, and take both out of the parent.
+      int sep = c > 0 ? c - 1 : 0;
+      if (left != NULL) {
+         left->keys[1] = p->keys[sep];
+         left->kids[2] = orphan;
+         left->count = 2;
+      }
+      else {
+         right->keys[1] = right->keys[0];
+         right->keys[0] = p->keys[sep];
+         right->kids[2] = right->kids[1];
+         right->kids[1] = right->kids[0];
+         right->kids[0] = orphan;
+         right->count = 2;
+      }
+      for (i = sep; i + 1 < p->count; i++)
+         p->keys[i] = p->keys[i + 1];
+      for (i = c; i < p->count; i++)
+         p->kids[i] = p->kids[i + 1];
+      p->kids[p->count] = 0;
+      p->count--;
+      release(seg, path[d]);
+      orphan = p->kids[0];
+      d--;
+   }
+   written(seg);
+   return true;
+}
+
+/*
+ * Equal keys can sit on either side of a separator equal to them, so a
+ * key equal to one in the node is a hit right there.
+ */
+bool shmtree_contains(float val, shmtree * sh) {
+   segment * seg = sh->seg;
+   sortkey key = tokey(val);
+   shmnode n;
+   uint64_t seq = 0;
+   bool found = false;
+   do {
+      seq = begin(sh);
+      uint32_t k = seg->root;
+      int depth = 0;
+      found = false;
+      while (!found && depth++ <= SHM_MAX_HEIGHT && peek(seg, k, &n)) {
+         int i = 0;
+         for (i = 0; i < n.count && n.keys[i] < key; i++)
+            ;
+         found = i < n.count && n.keys[i] == key;
+         k = n.kids[i];
+      }
+   } while (!end(sh, seq));
+   return found;
+}
+
+/*
+ * A tree of capacity keys has no more than capacity nodes, so a search
+ * that looks at more than that is lost in a half-written tree, and stops.
+ */
+uint64_t shmtree_range(float lo, float hi, shmtree * sh, float * out,
+                       uint64_t max) {
+   segment * seg = sh->seg;
+   uint64_t seq = 0;
+   uint64_t len = 0;
+   do {
+      uint64_t budget = seg->capacity;
+      seq = begin(sh);
+      len = 0;
+      collect(seg, seg->root, tokey(lo), tokey(hi), 0, &budget, out, &len,
+              max);
+   } while (!end(sh, seq));
+   return len;
+}
+
+uint64_t shmtree_len(shmtree * sh) {
+   uint64_t seq = 0;
+   uint64_t len = 0;
+   do {
+      seq = begin(sh);
+      len = sh->seg->len;
+   } while (!end(sh, seq));
+   return len;
+}
+
+//The header is aligned to a cache line, so node 0 starts on one.
+static uint64_t place(uint64_t capacity, uint64_t * arena) {
+   *arena = (sizeof(segment) + 63) & ~63ULL;
+   return *arena + sizeof(shmnode) * (capacity + 1);
+}
+
+static shmnode * at(segment * seg, uint32_t k) {
+   return (shmnode *)((char *)seg + seg->arena) + k;
+}
+
+static uint32_t grab(segment * seg) {
+   uint32_t k = seg->free;
+   if (k != 0)
+      seg->free = at(seg, k)->kids[0];
+   else
+      k = seg->unused++;
+   memset(at(seg, k), '\0', sizeof(shmnode));
+   return k;
+}
+
+static void release(segment * seg, uint32_t k) {
+   at(seg, k)->kids[0] = seg->free;
+   at(seg, k)->count = 0;
+   seg->free = k;
+}
+
+/*
+ * The release fence keeps the odd mark ahead of the writes to the nodes,
+ * and the release store of the even one keeps it behind them.
+ */
+static void writing(segment * seg) {
+   uint64_t seq = atomic_load_explicit(&seg->seq, memory_order_relaxed);
+   atomic_store_explicit(&seg->seq, seq + 1, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+}
+
+static void written(segment * seg) {
+   uint64_t seq = atomic_load_explicit(&seg->seq, memory_order_relaxed);
+   atomic_store_explicit(&seg->seq, seq + 1, memory_order_release);
+}
+
+/*
+ * A write is a single descent, so it is usually over in a spin or two,
+ * but a writer that lost its CPU partway can't finish while a reader spins
+ * on that CPU. Yielding lets it.
+ */
+static uint64_t begin(shmtree * sh) {
+   for (;;) {
+      uint64_t seq = atomic_load_explicit(&sh->seg->seq,
+                                          memory_order_acquire);
+      if ((seq & 1) == 0)
+         return seq;
+      sched_yield();
+   }
+}
+
+static bool end(shmtree * sh, uint64_t seq) {
+   atomic_thread_fence(memory_order_acquire);
+   if (atomic_load_explicit(&sh->seg->seq, memory_order_relaxed) == seq)
+      return true;
+   sh->retries++;
+   return false;
+}
+
+/*
+ * The node is copied before it is looked at, so a check made on the copy
+ * still holds when the copy is used, whatever the writer does meanwhile.
+ */
+static bool peek(segment * seg, uint32_t k, shmnode * out) {
+   if (k == 0 || k > seg->capacity)
+      return false;
+   *out = *at(seg, k);
+   if (out->count > 2 || out->count < 0)
+      out->count = out->count > 2 ? 2 : 0;
+   return true;
+}
+
+/*
+ * Kid i holds the keys between keys[i - 1] and keys[i], either end
+ * included, so it is only entered if that span meets [lo, hi].
+ */
+static void collect(segment * seg, uint32_t k, sortkey lo, sortkey hi,
+                    int depth, uint64_t * budget, float * out,
+                    uint64_t * len, uint64_t max) {
+   shmnode n;
+   int i = 0;
+   if (depth > SHM_MAX_HEIGHT || *budget == 0 || !peek(seg, k, &n))
+      return;
+   (*budget)--;
+   for (i = 0; i <= n.count && *len < max; i++) {
+      if ((i == 0 || n.keys[i - 1] <= hi) &&
+          (i == n.count || lo <= n.keys[i]))
+         collect(seg, n.kids[i], lo, hi, depth + 1, budget, out, len, max);
+      if (i < n.count && lo <= n.keys[i] && n.keys[i] <= hi && *len < max)
+         out[(*len)++] = fromkey(n.keys[i]);
+   }
+}
@@ -0,0 +1,77 @@
+/*
+ * "shmtree.h", by Sean Soderman
+ * Specification of a 2-3 tree that lives in a POSIX shared-memory segment,
+ * so that several processes can search the same tree in place, each
+ * without a copy of its own.
+ */
+#ifndef SHMTREE_H
+#define SHMTREE_H
+
+#include "tree23.h"
+
+/*
+ * One process creates the segment and is the tree's only writer; any
+ * number of processes open it read-only and search it. The nodes, the
+ * allocator's arena and free list, and the root all live in the segment.
+ * Nothing in it is a pointer: a node links to its children by their
+ * numbers in the arena, so each process can map the segment at whatever
+ * address it likes and finds node k at its own base plus k node sizes.
+ * Writes change the shared nodes directly, with no copying or
+ * serialization, so readers see every write as soon as it is done.
+ *
+ * Writers and readers are kept apart by a seqlock: the sequence number is
+ * odd while a write is changing nodes, and a reader that saw it change
+ * (or saw it odd) searches again. Readers never block the writer. A
+ * search that races a write may follow links that are half rewritten, so
+ * every link is checked against the arena's size and every descent is cut
+ * off at SHM_MAX_HEIGHT before anything it found is trusted.
+ *
+ * Like the private tree, a shared tree may hold several copies of a key.
+ */
+typedef struct sm {
+   struct sg * seg; //The mapped segment.
+   uint64_t size;   //Bytes mapped.
+   char * name;     //Set only in the creating process, which unlinks it.
+   //Searches this process had to redo because a write overtook them.
+   uint64_t retries;
+}shmtree;
+
+//No 2-3 tree with 2^32 nodes is taller than this.
+#define SHM_MAX_HEIGHT 34
+
+//Creates (or replaces) the shared-memory segment called name, holding an
+//empty tree with room for capacity keys, and maps it for writing. name is
+//a POSIX shm name, like "/keys". Returns NULL, with errno set, if that
+//fails or capacity doesn't fit in 32-bit node numbers.
+shmtree * create_shmtree(const char * name, uint64_t capacity);
+
+//Maps the segment called name read-only. Returns NULL, with errno set,
+//if there is no such segment or it isn't a shared tree.
+shmtree * open_shmtree(const char * name);
+
+//Unmaps the segment. In the process that created it, also unlinks it;
+//processes that still have it mapped keep their mapping.
+void delshmtree(shmtree * sh);
+
+//Inserts val into the shared tree. Only the creating process may write.
+//Returns false, changing nothing, if the tree already holds capacity keys
+//or sh was opened read-only.
+bool shmtree_insert(float val, shmtree * sh);
+
+//Removes one copy of val from the shared tree. Only the creating process
+//may write. Returns false if val wasn't there or sh was opened read-only.
+bool shmtree_rmval(float val, shmtree * sh);
+
+//Returns true if val is in the shared tree.
+bool shmtree_contains(float val, shmtree * sh);
+
+//Copies every value v with lo <= v <= hi (in key order) into out,
+//ascending, stopping after max values, all as of one point between
+//writes. Returns the number copied.
+uint64_t shmtree_range(float lo, float hi, shmtree * sh, float * out,
+                       uint64_t max);
+
+//Returns the number of keys in the shared tree.
+uint64_t shmtree_len(shmtree * sh);
+
+#endif
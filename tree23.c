@@ -2,7 +2,39 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
 #include "tree23.h"
+#include "nodepool.h"
+
+#ifndef FILTER_BITS_PER_KEY
+#define FILTER_BITS_PER_KEY 10
+#endif
+
+#ifndef FILTER_PROBES
+#define FILTER_PROBES 7
+#endif
+
+//Smallest number of keys a filter is sized for.
+#ifndef FILTER_MIN_KEYS
+#define FILTER_MIN_KEYS 1024
+#endif
+
+//64-bit words per filter block: one 64-byte cache line.
+#define FILTER_BLOCK_WORDS 8
+
+//Tombstones each insert into a lazy tree sweeps out of its nodes.
+//Writes a buffered tree keeps in arrival order before sorting them into a
+//run of their own. contains scans them one by one, so this stays small.
+#ifndef PENDING_TAIL
+#define PENDING_TAIL 32
+#endif
+
+#ifndef LAZY_SWEEP
+#define LAZY_SWEEP 1
+#endif
+
+//Slots of the tombstone table one sweep step looks at before giving up.
+#define LAZY_SCAN 64
 /*
  * "tree23.c", by Sean Soderman
  * Implementation of all necessary 2-3 tree functions, as well as
@@ -30,35 +62,329 @@ typedef enum f {
    DEL
 }fetch_style;
 
+/*
+ * A node replaced by path copying, along with the epoch of the write that
+ * replaced it. It may be recycled once every live snapshot is at least
+ * that new.
+ */
+typedef struct r {
+   node * n;
+   uint64_t epoch;
+}retiree;
+
+/*
+ * A detached piece of a tree during range removal: its root (NULL when
+ * empty) and its height, with leaves at height 0 and empty pieces at -1.
+ */
+typedef struct p {
+   node * root;
+   int height;
+}piece;
+
+/*
+ * Everything modmem needs to hand out and recycle one tree's nodes. Each
+ * tree owns one, so trees never share a slab and deleting one tree leaves
+ * every other tree's nodes alone.
+ */
+typedef struct a {
+   //The current memory buffer utilised by the tree.
+   node * mem_buf;
+   uint64_t buf_size;
+   uint64_t buf_ndx;
+   //Contains all memory buffers allocated for the tree.
+   node ** buffers;
+   uint64_t buffers_len;
+   uint64_t buffers_ndx;
+   //Nodes cleared by removals, waiting to be handed out again.
+   node ** delbuf;
+   uint64_t delbuf_len;
+   uint64_t delbuf_ndx;
+   //Set for trees made by create_pooled: nodes come from and go back to
+   //the shared pool instead, and live counts the ones this tree holds.
+   bool pooled;
+   uint64_t live;
+}allocator;
+
+/*
+ * A blocked Bloom filter: each key sets FILTER_PROBES bits, all inside one
+ * cache-line-sized block picked by its hash, so a lookup costs one cache
+ * miss instead of one per probe. Bits are never cleared; removals only
+ * count towards stale, and the filter is rebuilt from the tree once stale
+ * keys make up a third of it or live ones outgrow what it was sized for.
+ */
+typedef struct b {
+   uint64_t * bits;
+   uint64_t nblocks;
+   uint64_t capacity;
+   uint64_t live;
+   uint64_t stale;
+   uint64_t rebuilds;
+   //Lookups that asked the filter, ones it turned away, and ones it let
+   //through that the tree then didn't have.
+   uint64_t probes;
+   uint64_t negatives;
+   uint64_t false_positives;
+}filter;
+
+/*
+ * Tombstones: values a lazy tree's rmval has deleted without touching the
+ * nodes holding them. An open-addressed table maps each value to how many
+ * of its copies are dead; a slot with none is empty. The table has twice
+ * as many slots as the tombstones it may hold, so it never has to grow.
+ */
+typedef struct gs {
+   sortkey key;
+   uint32_t dead;
+}grave;
+
+typedef struct g {
+   //Key and count side by side, so a lookup costs one cache miss.
+   grave * slots;
+   uint64_t nslots;
+   uint64_t cap;
+   uint64_t count; //Tombstones, every dead copy counted.
+   uint64_t cursor; //The slot the next sweep starts from.
+   uint64_t buried;
+   uint64_t revived;
+   uint64_t swept;
+}graveyard;
+
+//Epoch stamped onto every node handed out by modmem, and the allocator it
+//comes from. Both are set by each write to the tree being written, and are
+//per thread so that different trees can be written at the same time.
+static _Thread_local uint64_t stamp = 0;
+static _Thread_local allocator * pool = NULL;
+
+//Bodies of the public functions of the same name, working on keys.
+static void kinsert(sortkey val, tree * root);
+static void krmval(sortkey val, tree * root);
+//Takes one copy of val out of the nodes, ignoring tombstones and filter.
+//Returns false if there was no copy to take.
+static bool kremove(sortkey val, tree * root);
+static bool ksearch(sortkey val, node * root);
+static bool kcontains(sortkey val, tree * root);
+static void krmval_topdown(sortkey val, tree * root);
+static uint64_t krmval_range(sortkey lo, sortkey hi, tree * root);
+//Removes every value in [lo, hi] from a tree with no snapshots by cutting
+//it apart and joining what is left. Returns how many values went.
+static uint64_t cutrange(sortkey lo, sortkey hi, tree * root);
+//Sorts len keys with a least significant byte first radix sort.
+static void radixsort(sortkey * keys, uint64_t len);
 //Inserts val into the tree pointed to by n.
-static void minsert(float val, node * n, direction dir);
+static void minsert(sortkey val, node * n, direction dir);
+//Splits the temp-4 node n, pushing its middle value up into its parent.
+static void split(node * n, direction dir);
+//Grows a new root above the temp-4 root node.
+static void growroot(tree * root);
+//Inserts val starting from the tree's finger. Returns false if the tree
+//is too small to have one, leaving the insert to the caller.
+static bool fingerinsert(sortkey val, tree * root);
+//Walks from the finger's node at level down to val's leaf, recording the
+//path. Returns the level the leaf is at.
+static int fingerdescend(sortkey val, finger * f, int level);
+//Queues a write in a buffered tree, flushing first if the buffer is full.
+static void enqueue(sortkey val, bool del, tree * t);
+//Applies the writes queued in a buffered tree, leaving tombstones be.
+static void replay(tree * t);
+//Sorts the newest queued writes into a run, then merges the newest runs
+//until each is longer than everything after it, or until only one is
+//left if all is set.
+static void seal(tree * t, bool all);
+//Merges the newest run, which starts at mid, into the one before it,
+//which starts at start.
+static void mergeruns(tree * t, uint32_t start, uint32_t mid);
+//Applies the writes queued for val to the (add, least) pair that kcontains
+//keeps. Returns false if there are none.
+static bool queued(tree * t, sortkey val, int64_t * add, int64_t * least);
+//Counts how many times val is stored under n.
+static uint64_t occurrences(node * n, sortkey val);
+//Mixes val's bits into a hash.
+static uint64_t keyhash(sortkey val);
+//Returns the filter block val's bits live in, and its in-block hash.
+static uint64_t * filterblock(filter * f, sortkey val, uint64_t * bitsel);
+//Sets val's bits in the filter.
+static void filterset(filter * f, sortkey val);
+//Records val in the tree's filter, growing the filter first if needed.
+static void filteradd(tree * t, sortkey val);
+//Returns false if val is definitely not in the tree.
+static bool filterprobe(filter * f, sortkey val);
+//Notes that count values are gone, rebuilding once many bits are stale.
+static void filterdrop(tree * t, uint64_t count);
+//Throws the filter's bits away and sets them again from every value in
+//the tree and its write buffer.
+static void filterbuild(tree * t);
+//Sets the filter bits of every value under n, or just counts them if f is
+//NULL. Returns how many there were.
+static uint64_t filterfill(filter * f, node * n);
+//Returns the slot val's tombstones are in, or the empty slot they would go
+//in if it has none.
+static uint64_t findgrave(graveyard * g, sortkey val);
+//Returns how many copies of val are dead, without touching the nodes.
+static uint64_t buried(tree * t, sortkey val);
+//Empties a slot, moving later slots of its run back so that no lookup
+//stops short at the hole.
+static void forget(graveyard * g, uint64_t slot);
+//Marks one live copy of val dead. Sweeps first if the table is full.
+static void bury(sortkey val, tree * t);
+//Brings one dead copy of val back to life. Returns false if there is none.
+static bool revive(sortkey val, tree * t);
+//Takes up to steps dead copies out of the nodes for good.
+static void sweep(tree * t, uint64_t steps);
+//Sweeps until there are no tombstones left.
+static void purge(tree * t);
+//Takes one dead copy of val out of the nodes for good.
+static void exhume(tree * t, sortkey val);
+//Forgets every tombstone for a value in [lo, hi], for when those values
+//are gone from the nodes already. Returns how many there were.
+static uint64_t unbury(tree * t, sortkey lo, sortkey hi);
+//Returns a copy of g, or NULL if there is nothing in it to copy.
+static graveyard * copygraves(graveyard * g);
+//Frees a tombstone table.
+static void delgraves(graveyard * g);
+//Returns the leftmost (rightmost) leaf once its extreme value is live,
+//exhuming dead copies of that value until it is. NULL if the tree is empty.
+static node * liveleaf(tree * t, bool leftmost);
+//Builds a subtree of the given height holding all len values.
+static node * build(const sortkey * vals, uint64_t len, int height,
+                    uint64_t child_cap, node * parent);
 //Turns n into a 2-node by inserting val into it.
-static void simpleswap(float val, node * n);
+static void simpleswap(sortkey val, node * n);
 //Turns n into a 3-node by inserting val into it.
-static void swapsort(float val, node * n);
+static void swapsort(sortkey val, node * n);
 //Function that encompasses (almost) all memory management the tree needs.
 static node * modmem(fetch_style f, node * node_to_clear);
+//Makes an empty tree, drawing its nodes from the shared pool if pooled.
+static tree * plant(bool pooled);
 //Helper function for rmval that does all the heavy lifting.
-static node * mrmval(float val, node * top_node);
+static node * mrmval(sortkey val, node * top_node, tree * t,
+                     bool * removed);
+//Refills the empty node curr and any ancestors that empty out in turn.
+//Returns the new root if the old one was used up, NULL otherwise.
+static node * repair(node * curr, tree * t);
+//Finds the leftmost (or rightmost) leaf by walking down the spine.
+static node * extremeleaf(tree * t, bool leftmost);
+//Takes the smallest (or largest) value out of the tree into *out.
+static bool popextreme(tree * t, bool leftmost, float * out);
+//Copies n's keys and children into arrays, leftmost first.
+//Returns the number of keys.
+static int unpack(node * n, sortkey * keys, node ** kids);
+//Rebuilds n from nkeys keys and nkeys + 1 children, adopting the children.
+static void pack(node * n, const sortkey * keys, node ** kids, int nkeys);
+//Moves a key from the 3-node sibling at kids[from] through the parent's
+//separator into the 2-node kids[to] (an adjacent sibling).
+static void rotate(node * parent, int from, int to);
+//Cuts the subtree at n in two: values below pivot (or equal to it too,
+//if inclusive) go to lo, the rest to hi.
+static void cut(node * n, int height, sortkey pivot, bool inclusive,
+                piece * lo, piece * hi);
+//Combines two pieces with key between them into one valid 2-3 tree.
+static piece join(piece a, sortkey key, piece b);
+//Hangs key and sub off the right (or left) end of n's spine. Returns the
+//node split off n if it overflowed, with the key to promote in promoted.
+static node * graftright(node * n, int height, sortkey key, piece sub,
+                         sortkey * promoted);
+static node * graftleft(node * n, int height, sortkey key, piece sub,
+                        sortkey * promoted);
+//Returns a new 2-node holding key, with children l and r.
+static node * make2(node * l, sortkey key, node * r);
+//Frees every node under n. Returns the number of values they held.
+static uint64_t freesub(node * n);
+//Appends every value in [lo, hi] under n to vals, growing it as needed.
+static void collect(node * n, sortkey lo, sortkey hi, sortkey ** vals,
+                    uint64_t * len, uint64_t * cap);
 //Discerns which child the node is.
 static direction discern_childhood(node * child, node * parent);
+//Returns a copy of n that is safe to write to if n may be shared with a
+//snapshot, or n itself otherwise.
+static node * own(node * n, tree * t);
+//Copies every node insert will write to while adding val.
+static void cow_insert(sortkey val, tree * t);
+//Copies every node rmval will write to while removing val.
+static void cow_remove(sortkey val, tree * t);
+//Recycles every retired node that no live snapshot can reach anymore.
+static void reclaim(tree * t);
 //Validates the 2-3 tree by checking if the ordering of its values are
 //correct. Returns true if the tree passes the test, false otherwise.
 bool isvalid(node * curr);
 
+/*
+ * Flipping the sign bit puts positive floats above negative ones. Flipping
+ * every other bit of a negative float as well reverses the order among
+ * the negatives, whose bits grow with their magnitude.
+ */
+sortkey tokey(float val) {
+   uint32_t bits;
+   memcpy(&bits, &val, sizeof(bits));
+   return bits ^ (-(bits >> 31) | 0x80000000u);
+}
+
+float fromkey(sortkey k) {
+   uint32_t bits = k ^ (((k >> 31) - 1) | 0x80000000u);
+   float val;
+   memcpy(&val, &bits, sizeof(val));
+   return val;
+}
+
 /*
  * Handles the initialization of the tree.
  */
 tree * create() {
+   return plant(false);
+}
+/*
+ * Same as create, but the tree's nodes come from the shared pool.
+ */
+tree * create_pooled() {
+   return plant(true);
+}
+
+static tree * plant(bool pooled) {
    tree * seed = malloc(sizeof(tree));
+   memset(seed, '\0', sizeof(tree));
+   seed->epoch = 1;
+   seed->fingers = true;
+   seed->mem = calloc(1, sizeof(allocator));
+   seed->mem->pooled = pooled;
+   stamp = seed->epoch;
+   pool = seed->mem;
    seed->root = modmem(GET, NULL);
    return seed;
 }
+/*
+ * Same as create, plus room for buflen queued writes.
+ */
+tree * create_buffered(uint32_t buflen) {
+   tree * seed = create();
+   seed->pending = malloc(sizeof(message) * (buflen + 1));
+   seed->merge_space = malloc(sizeof(message) * (buflen / 2 + 1));
+   seed->pending_cap = buflen;
+   return seed;
+}
 /*
  * Takes care of the deletion of the entire tree, including the tree struct.
  */
 void deltree(tree * root) {
+  while (root->snaps != NULL) {
+     snapshot * next = root->snaps->next;
+     delgraves(root->snaps->graves);
+     free(root->snaps);
+     root->snaps = next;
+  }
+  pool = root->mem;
+  //A pooled tree's nodes outlive it in the pool, so each one goes back.
+  if (root->mem->pooled) {
+     uint64_t i = 0;
+     (void)freesub(root->root);
+     for (i = 0; i < root->retired_ndx; i++)
+        modmem(DEL, root->retired[i].n);
+  }
+  free(root->retired);
+  free(root->pending);
+  free(root->merge_space);
+  tree_filter(root, false);
+  delgraves(root->graves);
   (void)modmem(FREE, NULL);
+  free(root->mem);
   memset(root, '\0', sizeof(root));
   free(root);
 }
@@ -67,6 +393,29 @@ void deltree(tree * root) {
  * Grows at the root if necessary.
  */
 void insert(float val, tree * root) {
+   kinsert(tokey(val), root);
+}
+
+static void kinsert(sortkey val, tree * root) {
+   if (root->pending_cap > 0) {
+      enqueue(val, false, root);
+      return;
+   }
+   if (root->filter != NULL)
+      filteradd(root, val);
+   if (root->graves != NULL) {
+      if (revive(val, root))
+         return;
+      sweep(root, LAZY_SWEEP);
+   }
+   stamp = root->epoch;
+   pool = root->mem;
+   if (root->snaps != NULL) {
+      root->last.depth = 0;
+      cow_insert(val, root);
+   }
+   else if (root->fingers && fingerinsert(val, root))
+      return;
    node * n = root->root;
    if (n->left || n->right) { //If I am a 2 or 3 node w/ children.
       if (val < n->ldata) {
@@ -81,35 +430,7 @@ void insert(float val, tree * root) {
    }
    //The root is a temp-4 node w/children, grow a new root and right node.
    if (n->is4node && n->mid_right) {
-      //Create new root, have old root's parent ptr point to it.
-      //Make sure to clear out the middle data as well.
-      node * new_root = modmem(GET, NULL);
-      n->parent = new_root;
-      new_root->ldata = n->mdata;
-      new_root->is2node = true;
-      n->mdata = 0;
-      //Have the new root point to the old one.
-      new_root->left = n;
-      //Create the new right branch of the tree as well. Migrate 
-      //the proper pointers over (including the parent pointers!)
-      node * new_right = modmem(GET, NULL);
-      new_root->right = new_right;
-      new_right->parent = new_root;
-      new_right->ldata = n->rdata;
-      new_right->is2node = true;
-      n->rdata = 0;
-      n->is4node = false;
-      n->is3node = false;
-      n->is2node = true;
-      new_right->left = n->mid_right;
-      new_right->right = n->right;
-      n->right = n->middle;
-      n->middle = NULL;
-      n->mid_right = NULL;
-      //Have grandchild parent pointers point to new right node.
-      new_right->left->parent = new_right;
-      new_right->right->parent = new_right;
-      root->root = new_root;
+      growroot(root);
    }
    //Initial case of inserting data: a full root node with no children.
    else if (n->is3node && n->left == NULL) {
@@ -129,6 +450,8 @@ void insert(float val, tree * root) {
       n->is3node = false;
       n->is2node = true;
       root->root = new_root;
+      root->minleaf = n;
+      root->maxleaf = new_right;
    }
    else if (n->is2node != true && n->left == NULL) {
       n->ldata = val;
@@ -140,25 +463,791 @@ void insert(float val, tree * root) {
 
 }
 
+/*
+ * Sorting first means each insert lands right next to the previous one,
+ * so the nodes on its path are still in cache. Integer keys can be radix
+ * sorted, which beats qsort's comparison calls by a wide margin.
+ */
+void insert_batch(float * vals, uint64_t len, tree * root) {
+   sortkey * keys = malloc(sizeof(sortkey) * (len + 1));
+   uint64_t i = 0;
+   for (i = 0; i < len; i++)
+      keys[i] = tokey(vals[i]);
+   radixsort(keys, len);
+   for (i = 0; i < len; i++) {
+      vals[i] = fromkey(keys[i]);
+      kinsert(keys[i], root);
+   }
+   free(keys);
+}
+
+/*
+ * Bottom-up construction from sorted input: O(n) with no splits at all.
+ * The height is the smallest one whose all-3-node tree can hold len
+ * values; build then splits the values evenly between 2 or 3 children so
+ * every leaf ends up at that depth.
+ */
+void bulkload(float * vals, uint64_t len, tree * root) {
+   tree_flush(root);
+   node * old = root->root;
+   if (len == 0)
+      return;
+   if (old->is2node || old->is3node || root->snaps != NULL) {
+      insert_batch(vals, len, root);
+      return;
+   }
+   sortkey * keys = malloc(sizeof(sortkey) * len);
+   bool sorted = true;
+   uint64_t i = 0;
+   for (i = 0; i < len; i++) {
+      keys[i] = tokey(vals[i]);
+      sorted = sorted && (i == 0 || keys[i - 1] <= keys[i]);
+   }
+   //Sorted as floats isn't quite sorted as keys: -0 and 0, or NaNs.
+   if (!sorted)
+      radixsort(keys, len);
+   stamp = root->epoch;
+   pool = root->mem;
+   root->last.depth = 0;
+   root->minleaf = root->maxleaf = NULL;
+   int height = 0;
+   uint64_t cap = 2; //Most values a tree of this height can hold.
+   uint64_t child_cap = 0;
+   while (cap < len) {
+      height++;
+      child_cap = cap;
+      cap = cap * 3 + 2;
+   }
+   root->root = build(keys, len, height, child_cap, NULL);
+   modmem(DEL, old);
+   for (i = 0; root->filter != NULL && i < len; i++)
+      filteradd(root, keys[i]);
+   free(keys);
+}
+
+static node * build(const sortkey * vals, uint64_t len, int height,
+                    uint64_t child_cap, node * parent) {
+   node * n = modmem(GET, NULL);
+   n->parent = parent;
+   if (height == 0) {
+      n->ldata = vals[0];
+      if (len == 2) {
+         n->rdata = vals[1];
+         n->is3node = true;
+      }
+      else
+         n->is2node = true;
+      return n;
+   }
+   //Two children hold at most 2 * child_cap values plus the separator.
+   int kids = len - 1 <= 2 * child_cap ? 2 : 3;
+   uint64_t rest = len - (kids - 1);
+   uint64_t share = rest / kids;
+   uint64_t extra = rest % kids;
+   uint64_t lsize = share + (extra > 0);
+   uint64_t msize = share + (extra > 1);
+   uint64_t grandchild_cap = (child_cap - 2) / 3;
+   n->left = build(vals, lsize, height - 1, grandchild_cap, n);
+   n->ldata = vals[lsize];
+   vals += lsize + 1;
+   if (kids == 3) {
+      n->middle = build(vals, msize, height - 1, grandchild_cap, n);
+      n->rdata = vals[msize];
+      vals += msize + 1;
+      n->is3node = true;
+   }
+   else
+      n->is2node = true;
+   n->right = build(vals, rest - lsize - (kids == 3 ? msize : 0),
+                    height - 1, grandchild_cap, n);
+   return n;
+}
+
+/*
+ * One counting pass per byte, skipping bytes that are the same in every
+ * key, which is common when the keys span a small range.
+ */
+static void radixsort(sortkey * keys, uint64_t len) {
+   sortkey * tmp = malloc(sizeof(sortkey) * (len + 1));
+   sortkey * from = keys;
+   sortkey * to = tmp;
+   uint64_t count[256];
+   uint64_t i = 0;
+   int shift = 0;
+   for (shift = 0; shift < 32 && len > 0; shift += 8) {
+      memset(count, '\0', sizeof(count));
+      for (i = 0; i < len; i++)
+         count[(from[i] >> shift) & 0xff]++;
+      if (count[(from[0] >> shift) & 0xff] == len)
+         continue;
+      uint64_t sum = 0;
+      int b = 0;
+      for (b = 0; b < 256; b++) {
+         uint64_t c = count[b];
+         count[b] = sum;
+         sum += c;
+      }
+      for (i = 0; i < len; i++)
+         to[count[(from[i] >> shift) & 0xff]++] = from[i];
+      sortkey * swap = from;
+      from = to;
+      to = swap;
+   }
+   if (from != keys)
+      memcpy(keys, from, sizeof(sortkey) * len);
+   free(tmp);
+}
+
+/*
+ * A one-level take on a B-epsilon tree's message buffers: writes wait at
+ * the top and are applied as a batch in key order. Consecutive keys in a
+ * batch land next to each other, so the insert finger turns most of the
+ * batch into short hops instead of full descents. Writes are appended,
+ * and every PENDING_TAIL of them are sorted into a run that is merged
+ * with runs of the same length, the way a log-structured merge tree
+ * keeps its levels, so each write is moved O(log(buffer / PENDING_TAIL))
+ * times before the replay rather than O(buffer).
+ */
+static void enqueue(sortkey val, bool del, tree * t) {
+   if (t->filter != NULL && !del)
+      filteradd(t, val);
+   else if (t->filter != NULL)
+      filterdrop(t, 1);
+   if (t->pending_len == t->pending_cap)
+      replay(t);
+   t->pending[t->pending_len].key = val;
+   t->pending[t->pending_len].del = del;
+   t->pending_len++;
+   if (t->pending_len - t->pending_sorted == PENDING_TAIL)
+      seal(t, false);
+}
+
+/*
+ * Insertion sort keeps equal keys in arrival order, and is quick at
+ * PENDING_TAIL messages. Runs only ever meet one of the same length
+ * unless all is set, so their lengths are PENDING_TAIL times distinct
+ * powers of two, and the newer of two runs being merged is never longer
+ * than half the buffer.
+ */
+static void seal(tree * t, bool all) {
+   uint32_t i = 0;
+   for (i = t->pending_sorted + 1; i < t->pending_len; i++) {
+      message m = t->pending[i];
+      uint32_t j = i;
+      for (; j > t->pending_sorted && t->pending[j - 1].key > m.key; j--)
+         t->pending[j] = t->pending[j - 1];
+      t->pending[j] = m;
+   }
+   if (t->pending_len > t->pending_sorted)
+      t->run_end[t->runs++] = t->pending_len;
+   t->pending_sorted = t->pending_len;
+   while (t->runs > 1) {
+      uint32_t mid = t->run_end[t->runs - 2];
+      uint32_t start = t->runs > 2 ? t->run_end[t->runs - 3] : 0;
+      if (!all && mid - start > t->pending_len - mid)
+         break;
+      mergeruns(t, start, mid);
+   }
+}
+
+/*
+ * The newer run is set aside and the two are merged from the back,
+ * taking the newer message on ties, so equal keys stay in arrival order.
+ */
+static void mergeruns(tree * t, uint32_t start, uint32_t mid) {
+   uint32_t end = t->pending_len;
+   uint32_t a = mid;
+   uint32_t b = end - mid;
+   uint32_t out = end;
+   memcpy(t->merge_space, t->pending + mid, sizeof(message) * b);
+   while (b > 0) {
+      if (a > start && t->pending[a - 1].key > t->merge_space[b - 1].key)
+         t->pending[--out] = t->pending[--a];
+      else
+         t->pending[--out] = t->merge_space[--b];
+   }
+   t->runs--;
+   t->run_end[t->runs - 1] = end;
+}
+
+void tree_flush(tree * root) {
+   replay(root);
+   if (root->graves != NULL)
+      purge(root);
+}
+
+static void replay(tree * root) {
+   uint32_t cap = root->pending_cap;
+   filter * f = root->filter;
+   uint32_t i = 0;
+   //Switch buffering off so insert and rmval go straight to the nodes.
+   //The filter already heard about these writes when they were queued.
+   seal(root, true);
+   root->pending_cap = 0;
+   root->filter = NULL;
+   for (i; i < root->pending_len; i++) {
+      if (root->pending[i].del)
+         krmval(root->pending[i].key, root);
+      else
+         kinsert(root->pending[i].key, root);
+   }
+   root->pending_len = 0;
+   root->pending_sorted = 0;
+   root->runs = 0;
+   root->pending_cap = cap;
+   root->filter = f;
+}
+
+/*
+ * Queued writes for val replay on top of the count already in the nodes,
+ * the same way they will when flushed (deleting a missing value does
+ * nothing), once val's tombstones are taken off that count. Without
+ * either, this is just search. An insert takes a count c to c + 1 and a
+ * delete to max(c - 1, 0), so any string of them takes it to
+ * max(c + add, least), and a positive least means val is there whatever
+ * the nodes hold.
+ */
+bool contains(float val, tree * root) {
+   return kcontains(tokey(val), root);
+}
+
+static bool kcontains(sortkey val, tree * root) {
+   int64_t add = 0;
+   int64_t least = 0;
+   if (root->filter != NULL && !filterprobe(root->filter, val))
+      return false;
+   bool found = false;
+   bool writes = queued(root, val, &add, &least);
+   uint64_t dead = buried(root, val);
+   if (dead == 0 && !writes)
+      found = ksearch(val, root->root);
+   else
+      found = least > 0 ||
+              (int64_t)(occurrences(root->root, val) - dead) + add > 0;
+   if (root->filter != NULL && !found)
+      root->filter->false_positives++;
+   return found;
+}
+
+/*
+ * Runs are searched oldest first and the unsorted tail scanned last, so
+ * the writes are applied in the order they arrived.
+ */
+static bool queued(tree * t, sortkey val, int64_t * add, int64_t * least) {
+   uint32_t start = 0;
+   uint32_t i = 0;
+   bool any = false;
+   int r = 0;
+   for (r = 0; r <= t->runs; r++) {
+      uint32_t end = r < t->runs ? t->run_end[r] : t->pending_len;
+      uint32_t lo = start;
+      uint32_t hi = end;
+      while (r < t->runs && lo < hi) {
+         uint32_t mid = lo + (hi - lo) / 2;
+         if (t->pending[mid].key < val)
+            lo = mid + 1;
+         else
+            hi = mid;
+      }
+      for (i = lo; i < end && (r == t->runs || t->pending[i].key == val);
+           i++) {
+         if (t->pending[i].key != val)
+            continue;
+         any = true;
+         *add += t->pending[i].del ? -1 : 1;
+         *least = t->pending[i].del ? (*least > 0 ? *least - 1 : 0) :
+                                      *least + 1;
+      }
+      start = end;
+   }
+   return any;
+}
+
+static uint64_t occurrences(node * n, sortkey val) {
+   if (n == NULL || (!n->is2node && !n->is3node))
+      return 0;
+   uint64_t count = 0;
+   if (val <= n->ldata)
+      count += occurrences(n->left, val);
+   count += n->ldata == val;
+   if (n->is3node) {
+      if (n->ldata <= val && val <= n->rdata)
+         count += occurrences(n->middle, val);
+      count += n->rdata == val;
+   }
+   if ((n->is3node ? n->rdata : n->ldata) <= val)
+      count += occurrences(n->right, val);
+   return count;
+}
+
+void tree_filter(tree * root, bool on) {
+   if (on && root->filter == NULL) {
+      root->filter = calloc(1, sizeof(filter));
+      filterbuild(root);
+   }
+   else if (!on && root->filter != NULL) {
+      free(root->filter->bits);
+      free(root->filter);
+      root->filter = NULL;
+   }
+}
+
+/*
+ * The expected false positive rate comes from how full the filter is: a
+ * missing key gets through when all of its bits happen to be set.
+ */
+void tree_stats(tree * root) {
+   filter * f = root->filter;
+   allocator * a = root->mem;
+   uint64_t set = 0;
+   uint64_t reserved = 0;
+   uint64_t i = 0;
+   //Slab i holds 8192 * 2^i nodes; only the newest is partly handed out.
+   for (i = 0; a->mem_buf != NULL && i <= a->buffers_ndx; i++)
+      reserved += 8192ULL << i;
+   uint64_t used = a->mem_buf == NULL ? 0 :
+                   reserved - a->buf_size + a->buf_ndx - a->delbuf_ndx;
+   if (a->pooled)
+      printf("nodes: %llu in use, %llu bytes each, from the shared pool "
+             "(%llu bytes reserved by it)\n", (unsigned long long)a->live,
+             (unsigned long long)sizeof(node),
+             (unsigned long long)(nodepool_reserved() * sizeof(node)));
+   else
+      printf("nodes: %llu in use, %llu bytes each, %llu bytes reserved\n",
+             (unsigned long long)used, (unsigned long long)sizeof(node),
+             (unsigned long long)(reserved * sizeof(node)));
+   if (root->graves != NULL) {
+      graveyard * g = root->graves;
+      uint64_t stored = filterfill(NULL, root->root);
+      printf("tombstones: %llu of %llu stored values (%.3f%%), room for %llu; "
+             "%llu buried, %llu revived, %llu swept\n",
+             (unsigned long long)g->count, (unsigned long long)stored,
+             stored == 0 ? 0.0 : 100.0 * g->count / stored,
+             (unsigned long long)g->cap, (unsigned long long)g->buried,
+             (unsigned long long)g->revived, (unsigned long long)g->swept);
+   }
+   else
+      printf("tombstones: off\n");
+   if (f == NULL) {
+      printf("filter: off\n");
+      return;
+   }
+   for (i = 0; i < f->nblocks * FILTER_BLOCK_WORDS; i++)
+      set += __builtin_popcountll(f->bits[i]);
+   double fill = (double)set / (f->nblocks * FILTER_BLOCK_WORDS * 64);
+   double expected = 1;
+   for (i = 0; i < FILTER_PROBES; i++)
+      expected *= fill;
+   uint64_t passed = f->probes - f->negatives;
+   uint64_t absent = f->negatives + f->false_positives;
+   printf("filter: %llu bytes, sized for %llu keys, %llu live, %llu stale, "
+          "%llu rebuilds\n",
+          (unsigned long long)(f->nblocks * FILTER_BLOCK_WORDS *
+                               sizeof(uint64_t)),
+          (unsigned long long)f->capacity, (unsigned long long)f->live,
+          (unsigned long long)f->stale, (unsigned long long)f->rebuilds);
+   printf("filter: %llu lookups, %llu turned away, %llu let through, "
+          "%llu false positives (%.3f%% of misses, %.3f%% expected)\n",
+          (unsigned long long)f->probes, (unsigned long long)f->negatives,
+          (unsigned long long)passed, (unsigned long long)f->false_positives,
+          absent ? 100.0 * f->false_positives / absent : 0.0,
+          100.0 * expected);
+}
+
+static uint64_t keyhash(sortkey val) {
+   uint64_t h = (val + 1ULL) * 0x9E3779B97F4A7C15ULL;
+   h ^= h >> 29;
+   h *= 0xBF58476D1CE4E5B9ULL;
+   h ^= h >> 32;
+   return h;
+}
+
+/*
+ * The top half of the hash picks the block. The bottom half is remixed
+ * into FILTER_PROBES 9-bit fields, each naming one of the block's 512 bits.
+ */
+static uint64_t * filterblock(filter * f, sortkey val, uint64_t * bitsel) {
+   uint64_t h = keyhash(val);
+   uint64_t block = ((h >> 32) * f->nblocks) >> 32;
+   *bitsel = (h & 0xffffffffULL) * 0xD6E8FEB86659FD93ULL;
+   return f->bits + block * FILTER_BLOCK_WORDS;
+}
+
+static void filterset(filter * f, sortkey val) {
+   uint64_t sel = 0;
+   int i = 0;
+   uint64_t * block = filterblock(f, val, &sel);
+   for (i = 0; i < FILTER_PROBES; i++, sel >>= 9)
+      block[(sel & 511) >> 6] |= 1ULL << (sel & 63);
+}
+
+static void filteradd(tree * t, sortkey val) {
+   filter * f = t->filter;
+   if (f->live >= f->capacity)
+      filterbuild(t);
+   f->live++;
+   filterset(f, val);
+}
+
+static bool filterprobe(filter * f, sortkey val) {
+   uint64_t sel = 0;
+   int i = 0;
+   uint64_t * block = filterblock(f, val, &sel);
+   f->probes++;
+   for (i = 0; i < FILTER_PROBES; i++, sel >>= 9) {
+      if (!(block[(sel & 511) >> 6] & (1ULL << (sel & 63)))) {
+         f->negatives++;
+         return false;
+      }
+   }
+   return true;
+}
+
+static void filterdrop(tree * t, uint64_t count) {
+   filter * f = t->filter;
+   f->stale += count;
+   f->live -= count < f->live ? count : f->live;
+   if (f->stale > FILTER_MIN_KEYS && f->stale > f->live / 2)
+      filterbuild(t);
+}
+
+/*
+ * Counting the values first sizes the new filter at twice what the tree
+ * holds, so it can take as many inserts again before the next rebuild.
+ * Queued deletes are counted as values too; an extra bit or two set is
+ * harmless.
+ */
+static void filterbuild(tree * t) {
+   filter * f = t->filter;
+   uint32_t i = 0;
+   uint64_t live = filterfill(NULL, t->root) + t->pending_len;
+   f->capacity = live * 2 > FILTER_MIN_KEYS ? live * 2 : FILTER_MIN_KEYS;
+   f->nblocks = (f->capacity * FILTER_BITS_PER_KEY + 511) / 512;
+   free(f->bits);
+   f->bits = calloc(f->nblocks * FILTER_BLOCK_WORDS, sizeof(uint64_t));
+   (void)filterfill(f, t->root);
+   for (i = 0; i < t->pending_len; i++)
+      filterset(f, t->pending[i].key);
+   f->live = live;
+   f->stale = 0;
+   f->rebuilds++;
+}
+
+static uint64_t filterfill(filter * f, node * n) {
+   uint64_t count = 0;
+   if (n == NULL || (!n->is2node && !n->is3node))
+      return 0;
+   count += filterfill(f, n->left) + filterfill(f, n->middle) +
+            filterfill(f, n->right);
+   if (f != NULL)
+      filterset(f, n->ldata);
+   if (f != NULL && n->is3node)
+      filterset(f, n->rdata);
+   return count + (n->is3node ? 2 : 1);
+}
+
+/*
+ * Sweeping everything first means a table that shrinks never has to hold
+ * more tombstones than it has room for.
+ */
+void tree_lazy(tree * root, uint32_t max_tombstones) {
+   graveyard * g = root->graves;
+   if (g != NULL) {
+      purge(root);
+      delgraves(g);
+      root->graves = NULL;
+   }
+   if (max_tombstones == 0)
+      return;
+   g = calloc(1, sizeof(graveyard));
+   g->cap = max_tombstones;
+   g->nslots = 16;
+   while (g->nslots < 2 * g->cap)
+      g->nslots *= 2;
+   g->slots = calloc(g->nslots, sizeof(grave));
+   root->graves = g;
+}
+
+uint64_t tree_sweep(tree * root, uint64_t steps) {
+   if (root->graves == NULL)
+      return 0;
+   sweep(root, steps);
+   return root->graves->count;
+}
+
+//Linear probing, starting where keyhash's top bits point.
+static uint64_t findgrave(graveyard * g, sortkey val) {
+   uint64_t slot = (keyhash(val) >> 32) & (g->nslots - 1);
+   while (g->slots[slot].dead != 0 && g->slots[slot].key != val)
+      slot = (slot + 1) & (g->nslots - 1);
+   return slot;
+}
+
+static uint64_t buried(tree * t, sortkey val) {
+   if (t->graves == NULL || t->graves->count == 0)
+      return 0;
+   return t->graves->slots[findgrave(t->graves, val)].dead;
+}
+
+/*
+ * A later slot can move into the hole unless the slot its hash points to
+ * lies cyclically between the hole and it: then the lookup would start
+ * past the hole and never reach it.
+ */
+static void forget(graveyard * g, uint64_t slot) {
+   uint64_t mask = g->nslots - 1;
+   uint64_t next = (slot + 1) & mask;
+   g->slots[slot].dead = 0;
+   while (g->slots[next].dead != 0) {
+      uint64_t home = (keyhash(g->slots[next].key) >> 32) & mask;
+      if (((next - home) & mask) >= ((next - slot) & mask)) {
+         g->slots[slot] = g->slots[next];
+         g->slots[next].dead = 0;
+         slot = next;
+      }
+      next = (next + 1) & mask;
+   }
+}
+
+/*
+ * Counting val's copies (or just finding one, if none are dead yet) is a
+ * descent like search's, and nothing else here touches the nodes: no swap
+ * with a successor, no merges. Deleting a value with no live copy does
+ * nothing, the same as rmval.
+ */
+static void bury(sortkey val, tree * t) {
+   graveyard * g = t->graves;
+   while (g->count >= g->cap)
+      sweep(t, 1);
+   uint64_t slot = findgrave(g, val);
+   uint32_t dead = g->slots[slot].dead;
+   if (dead == 0 ? !ksearch(val, t->root) :
+       occurrences(t->root, val) <= dead)
+      return;
+   g->slots[slot].key = val;
+   g->slots[slot].dead++;
+   g->count++;
+   g->buried++;
+   if (t->filter != NULL)
+      filterdrop(t, 1);
+}
+
+static bool revive(sortkey val, tree * t) {
+   graveyard * g = t->graves;
+   if (g->count == 0)
+      return false;
+   uint64_t slot = findgrave(g, val);
+   if (g->slots[slot].dead == 0)
+      return false;
+   if (--g->slots[slot].dead == 0)
+      forget(g, slot);
+   g->count--;
+   g->revived++;
+   return true;
+}
+
+/*
+ * Each step takes the first tombstone at or after the cursor out of the
+ * nodes with an ordinary removal. A value is never dead more times than
+ * it is stored, so there is always a copy to remove. Forgetting a slot
+ * only moves later slots back, into the cursor's path, never behind it.
+ * A step that finds nothing within LAZY_SCAN slots is spent anyway, so no
+ * step costs more than that.
+ */
+static void sweep(tree * t, uint64_t steps) {
+   graveyard * g = t->graves;
+   uint64_t scanned = 0;
+   while (steps > 0 && g->count > 0) {
+      uint64_t slot = g->cursor;
+      if (g->slots[slot].dead == 0) {
+         g->cursor = (slot + 1) & (g->nslots - 1);
+         if (++scanned == LAZY_SCAN) {
+            scanned = 0;
+            steps--;
+         }
+         continue;
+      }
+      (void)kremove(g->slots[slot].key, t);
+      if (--g->slots[slot].dead == 0)
+         forget(g, slot);
+      g->count--;
+      g->swept++;
+      scanned = 0;
+      steps--;
+   }
+}
+
+static void purge(tree * t) {
+   while (t->graves->count > 0)
+      sweep(t, t->graves->count);
+}
+
+static void exhume(tree * t, sortkey val) {
+   graveyard * g = t->graves;
+   uint64_t slot = findgrave(g, val);
+   (void)kremove(val, t);
+   if (--g->slots[slot].dead == 0)
+      forget(g, slot);
+   g->count--;
+   g->swept++;
+}
+
+/*
+ * Forgetting slot i only moves later slots of its run into i, so i is
+ * looked at again until it holds something to keep. A run that wraps
+ * around can move a slot from the front of the table to the back, but
+ * that slot was already kept once.
+ */
+static uint64_t unbury(tree * t, sortkey lo, sortkey hi) {
+   graveyard * g = t->graves;
+   uint64_t gone = 0;
+   uint64_t i = 0;
+   if (g == NULL)
+      return 0;
+   for (i = 0; i < g->nslots && g->count > 0; i++) {
+      while (g->slots[i].dead != 0 && lo <= g->slots[i].key &&
+             g->slots[i].key <= hi) {
+         gone += g->slots[i].dead;
+         g->count -= g->slots[i].dead;
+         g->swept += g->slots[i].dead;
+         forget(g, i);
+      }
+   }
+   return gone;
+}
+
+static graveyard * copygraves(graveyard * g) {
+   if (g == NULL || g->count == 0)
+      return NULL;
+   graveyard * copy = malloc(sizeof(graveyard));
+   *copy = *g;
+   copy->slots = malloc(sizeof(grave) * g->nslots);
+   memcpy(copy->slots, g->slots, sizeof(grave) * g->nslots);
+   return copy;
+}
+
+static void delgraves(graveyard * g) {
+   if (g == NULL)
+      return;
+   free(g->slots);
+   free(g);
+}
+
 /*
  * Prints all values of the tree in order, using depth-first traversal.
  */
 void treeprint(node * root) {
    if (root->left != NULL)
       treeprint(root->left);
-   printf("ldata: %f\n", root->ldata); 
+   printf("ldata: %f\n", fromkey(root->ldata));
    if (root->middle != NULL)
       treeprint(root->middle);
    if (root->is3node) {
-      printf("rdata: %f\n", root->rdata);
+      printf("rdata: %f\n", fromkey(root->rdata));
    }
    if (root->right != NULL)
       treeprint(root->right);
 }
 
+/*
+ * Looks for val with a plain top-down descent. Never touches parent
+ * pointers, so it works on snapshots too.
+ */
+bool search(float val, node * root) {
+   return ksearch(tokey(val), root);
+}
+
+static bool ksearch(sortkey val, node * root) {
+   node * n = root;
+   while (n != NULL && (n->is2node || n->is3node)) {
+      if (n->ldata == val || (n->is3node && n->rdata == val))
+         return true;
+      if (val < n->ldata)
+         n = n->left;
+      else if (n->is3node && val < n->rdata)
+         n = n->middle;
+      else
+         n = n->right;
+   }
+   return false;
+}
+
+/*
+ * Same descent, leaf insertion and splitting as insert and minsert, just
+ * iterative, so it can start partway down the remembered path. Once the
+ * splits stop climbing, only the path below the highest node that changed
+ * is stale, and that is walked again for the next insert.
+ */
+static bool fingerinsert(sortkey val, tree * root) {
+   finger * f = &root->last;
+   if (root->root->left == NULL) {
+      f->depth = 0;
+      return false;
+   }
+   int level = f->depth - 1;
+   if (f->depth == 0 || f->path[0] != root->root) {
+      f->path[0] = root->root;
+      f->lo[0] = 0;
+      f->hi[0] = UINT32_MAX;
+      level = 0;
+   }
+   while (level > 0 && !(f->lo[level] <= val && val < f->hi[level]))
+      level--;
+   level = fingerdescend(val, f, level);
+   node * n = f->path[level];
+   if (n->is2node) {
+      simpleswap(val, n);
+      return true;
+   }
+   swapsort(val, n);
+   n->is4node = true;
+   while (n->is4node && level > 0) {
+      split(n, (direction)f->dir[level]);
+      n = f->path[--level];
+   }
+   if (n->is4node) {
+      growroot(root);
+      f->path[0] = root->root;
+   }
+   (void)fingerdescend(val, f, level);
+   return true;
+}
+
+static int fingerdescend(sortkey val, finger * f, int level) {
+   node * n = f->path[level];
+   while (n->left != NULL) {
+      sortkey lo = f->lo[level];
+      sortkey hi = f->hi[level];
+      int dir;
+      if (val < n->ldata) {
+         hi = n->ldata;
+         n = n->left;
+         dir = left;
+      }
+      else if (n->middle != NULL && val < n->rdata) {
+         lo = n->ldata;
+         hi = n->rdata;
+         n = n->middle;
+         dir = middle;
+      }
+      else {
+         lo = n->middle != NULL ? n->rdata : n->ldata;
+         n = n->right;
+         dir = right;
+      }
+      level++;
+      f->path[level] = n;
+      f->lo[level] = lo;
+      f->hi[level] = hi;
+      f->dir[level] = dir;
+   }
+   f->depth = level + 1;
+   return level;
+}
+
 //Helper function for insert. Does all the heavy lifting save for growth
 //at the root node, which is reserved for insert itself.
-static void minsert(float val, node * n, direction dir) {
+static void minsert(sortkey val, node * n, direction dir) {
    //Shameless copy from insert. The logic is identical...
    if (n->left || n->right) { //If I am a 2 or 3 node w/ children.
       if (val < n->ldata) {
@@ -180,103 +1269,170 @@ static void minsert(float val, node * n, direction dir) {
    }
    //The node has overflowed! Split accordingly.
    if (n->is4node) {
-      node * parent = n->parent;
-      float promoted_val = n->mdata;
-      if (parent->is2node) { //Parent is a 2-node
-         simpleswap(promoted_val, parent);
-         node * new_node = modmem(GET, NULL);
-         new_node->parent = parent;
-         parent->middle = new_node;
-         switch(dir) {
-            case left:
-               new_node->ldata = n->rdata;
-               //Transfer pointers unconditionally, since it wouldn't hurt
-               //either way
-               new_node->left = n->mid_right;
-               new_node->right = n->right;
-               if (new_node->left != NULL) {
-                  new_node->left->parent = new_node;
-                  new_node->right->parent = new_node;
-               }
-               n->right = n->middle;
-               break;
-            case right:
-               new_node->ldata = n->ldata;
-               n->ldata = n->rdata;
-               //As above, unconditional pointer xfer.
-               new_node->left = n->left;
-               new_node->right = n->middle;
-               if (new_node->left != NULL) {
-                  new_node->left->parent = new_node;
-                  new_node->right->parent = new_node;
-               }
-               n->left = n->mid_right;
-               break;
-         }
-         n->mid_right = NULL;
-         n->middle = NULL;
-         n->rdata = 0;
-         new_node->is2node = true;
-      }
-      else { //Parent is a 3-node.
-         swapsort(promoted_val, parent);
-         parent->is4node = true;
-         node * new_node = modmem(GET, NULL);
-         new_node->parent = parent;
-         switch(dir) {
-            case left: //Rearrange for left
-
-               parent->mid_right = parent->middle;
-               parent->middle = new_node;
-               new_node->ldata = n->rdata;
-               new_node->left = n->mid_right;
-               new_node->right = n->right;
-               if (new_node->left != NULL) {
-                  new_node->left->parent = new_node;
-                  new_node->right->parent = new_node;
-               }
-               n->right = n->middle;
-               break;
-            case middle: //Rearrange for middle
-               parent->mid_right = new_node;
-               new_node->ldata = n->rdata;
-               new_node->left = n->mid_right;
-               new_node->right = n->right;
-               if (new_node->left != NULL) {
-                  new_node->left->parent = new_node;
-                  new_node->right->parent = new_node;
-               }
-               n->right = n->middle;
-               break;
-            case right: //Rearrange for right
-               parent->mid_right = new_node;
-               new_node->ldata = n->ldata;
-               n->ldata = n->rdata;
-               new_node->left = n->left;
-               new_node->right = n->middle;
-               if (new_node->left != NULL) {
-                  new_node->left->parent = new_node;
-                  new_node->right->parent = new_node;
-               }
-               n->left = n->mid_right;
-               break;
-         }
-         n->rdata = 0;
-         n->middle = NULL;
-         n->mid_right = NULL;
-         new_node->is2node = true;
+      split(n, dir);
+   }
+}
+
+/*
+ * The node has overflowed! Split accordingly. dir is which child of its
+ * parent n is; the parent may be left a temp-4 node itself.
+ */
+static void split(node * n, direction dir) {
+   node * parent = n->parent;
+   sortkey promoted_val = n->mdata;
+   if (parent->is2node) { //Parent is a 2-node
+      simpleswap(promoted_val, parent);
+      node * new_node = modmem(GET, NULL);
+      new_node->parent = parent;
+      parent->middle = new_node;
+      switch(dir) {
+         case left:
+            new_node->ldata = n->rdata;
+            //Transfer pointers unconditionally, since it wouldn't hurt
+            //either way
+            new_node->left = n->mid_right;
+            new_node->right = n->right;
+            if (new_node->left != NULL) {
+               new_node->left->parent = new_node;
+               new_node->right->parent = new_node;
+            }
+            n->right = n->middle;
+            break;
+         case right:
+            new_node->ldata = n->ldata;
+            n->ldata = n->rdata;
+            //As above, unconditional pointer xfer.
+            new_node->left = n->left;
+            new_node->right = n->middle;
+            if (new_node->left != NULL) {
+               new_node->left->parent = new_node;
+               new_node->right->parent = new_node;
+            }
+            n->left = n->mid_right;
+            break;
       }
-      n->mdata = 0; //Clean up temp value storage.
-      n->is2node = true;
-      n->is3node = false;
-      n->is4node = false;
+      n->mid_right = NULL;
+      n->middle = NULL;
+      n->rdata = 0;
+      new_node->is2node = true;
    }
+   else { //Parent is a 3-node.
+      swapsort(promoted_val, parent);
+      parent->is4node = true;
+      node * new_node = modmem(GET, NULL);
+      new_node->parent = parent;
+      switch(dir) {
+         case left: //Rearrange for left
+
+            parent->mid_right = parent->middle;
+            parent->middle = new_node;
+            new_node->ldata = n->rdata;
+            new_node->left = n->mid_right;
+            new_node->right = n->right;
+            if (new_node->left != NULL) {
+               new_node->left->parent = new_node;
+               new_node->right->parent = new_node;
+            }
+            n->right = n->middle;
+            break;
+         case middle: //Rearrange for middle
+            parent->mid_right = new_node;
+            new_node->ldata = n->rdata;
+            new_node->left = n->mid_right;
+            new_node->right = n->right;
+            if (new_node->left != NULL) {
+               new_node->left->parent = new_node;
+               new_node->right->parent = new_node;
+            }
+            n->right = n->middle;
+            break;
+         case right: //Rearrange for right
+            parent->mid_right = new_node;
+            new_node->ldata = n->ldata;
+            n->ldata = n->rdata;
+            new_node->left = n->left;
+            new_node->right = n->middle;
+            if (new_node->left != NULL) {
+               new_node->left->parent = new_node;
+               new_node->right->parent = new_node;
+            }
+            n->left = n->mid_right;
+            break;
+      }
+      n->rdata = 0;
+      n->middle = NULL;
+      n->mid_right = NULL;
+      new_node->is2node = true;
+   }
+   n->mdata = 0; //Clean up temp value storage.
+   n->is2node = true;
+   n->is3node = false;
+   n->is4node = false;
+}
+
+/*
+ * The root is a temp-4 node w/children, grow a new root and right node.
+ */
+static void growroot(tree * root) {
+   node * n = root->root;
+   //Create new root, have old root's parent ptr point to it.
+   //Make sure to clear out the middle data as well.
+   node * new_root = modmem(GET, NULL);
+   n->parent = new_root;
+   new_root->ldata = n->mdata;
+   new_root->is2node = true;
+   n->mdata = 0;
+   //Have the new root point to the old one.
+   new_root->left = n;
+   //Create the new right branch of the tree as well. Migrate 
+   //the proper pointers over (including the parent pointers!)
+   node * new_right = modmem(GET, NULL);
+   new_root->right = new_right;
+   new_right->parent = new_root;
+   new_right->ldata = n->rdata;
+   new_right->is2node = true;
+   n->rdata = 0;
+   n->is4node = false;
+   n->is3node = false;
+   n->is2node = true;
+   new_right->left = n->mid_right;
+   new_right->right = n->right;
+   n->right = n->middle;
+   n->middle = NULL;
+   n->mid_right = NULL;
+   //Have grandchild parent pointers point to new right node.
+   new_right->left->parent = new_right;
+   new_right->right->parent = new_right;
+   root->root = new_root;
 }
 
 /*
  * Removes the value "val" from the tree.
  */
 void rmval(float val, tree * root) {
+   krmval(tokey(val), root);
+}
+
+static void krmval(sortkey val, tree * root) {
+   if (root->pending_cap > 0) {
+      enqueue(val, true, root);
+      return;
+   }
+   if (root->graves != NULL) {
+      bury(val, root);
+      return;
+   }
+   if (kremove(val, root) && root->filter != NULL)
+      filterdrop(root, 1);
+}
+
+static bool kremove(sortkey val, tree * root) {
+   bool removed = false;
+   stamp = root->epoch;
+   pool = root->mem;
+   root->last.depth = 0;
+   if (root->snaps != NULL)
+      cow_remove(val, root);
    node * top_node = root->root;
    //If this is just a root with no children..
    if (top_node->left == NULL) {
@@ -288,33 +1444,39 @@ void rmval(float val, tree * root) {
             top_node->rdata = 0;
             top_node->is3node = false;
             top_node->is2node = true;
+            removed = true;
          }
          else if (top_node->rdata == val) {
             top_node->rdata = 0;
             top_node->is3node = false;
             top_node->is2node = true;
+            removed = true;
          }
       }
       else if (top_node->is2node) {
          if (top_node->ldata == val) {
             top_node->ldata = 0;
             top_node->is2node = false;
+            removed = true;
          }
       }
-      return;
+      return removed;
    }
       
-   node * new_root = mrmval(val, top_node);
+   node * new_root = mrmval(val, top_node, root, &removed);
    //If my root node has been cleared...
    if (new_root != NULL) {
      root->root = new_root;
      modmem(DEL, new_root->parent);
      new_root->parent = NULL;
    }
+   return removed;
 }
 
-//Helper function for rmval that does all the heavy lifting.
-static node * mrmval(float val, node * top_node) {
+//Helper function for rmval that does all the heavy lifting. Sets *removed
+//if val was found and taken out.
+static node * mrmval(sortkey val, node * top_node, tree * t,
+                     bool * removed) {
    //Points to the node with a matching value.
    node * node_to_swap = NULL;
    node * curr = top_node;
@@ -393,6 +1555,16 @@ static node * mrmval(float val, node * top_node) {
          //fprintf(stderr, "Value not found!\n");
          return NULL;
    }
+   *removed = true;
+   return repair(curr, t);
+}
+
+/*
+ * The 2nd half of mrmval, on its own so pop_min and pop_max can empty a
+ * leaf directly and start here. Merging away the tree's leftmost or
+ * rightmost leaf hands that role to the sibling it merged into.
+ */
+static node * repair(node * curr, tree * t) {
    //2nd loop: Pointer reorganisation, traverse upwards when necessary.
    //Iterate only when my current node is empty.
    while(!curr->is2node && !curr->is3node) {
@@ -504,6 +1676,8 @@ static node * mrmval(float val, node * top_node) {
                   rchild->left = curr->left;
                   if (rchild->left != NULL)
                      rchild->left->parent = rchild;
+                  if (t->minleaf == curr)
+                     t->minleaf = rchild;
                   modmem(DEL, curr);
                   curr = parent;
                   curr->is2node = false;
@@ -612,6 +1786,8 @@ static node * mrmval(float val, node * top_node) {
                   parent->is2node = false;
                   if (lchild->right != NULL)
                      lchild->right->parent = lchild;
+                  if (t->maxleaf == curr)
+                     t->maxleaf = lchild;
                   modmem(DEL, curr);
                   curr = parent;
                   curr->right = NULL;
@@ -691,6 +1867,586 @@ static node * mrmval(float val, node * top_node) {
             break;
       }
    } 
+   return NULL;
+}
+
+/*
+ * The smallest value always sits at the front of the leftmost leaf (and
+ * the largest at the back of the rightmost one), so with those leaves
+ * cached a peek never descends.
+ */
+bool tree_min(tree * root, float * out) {
+   replay(root);
+   node * leaf = liveleaf(root, true);
+   if (leaf == NULL)
+      return false;
+   *out = fromkey(leaf->ldata);
+   return true;
+}
+
+bool tree_max(tree * root, float * out) {
+   replay(root);
+   node * leaf = liveleaf(root, false);
+   if (leaf == NULL)
+      return false;
+   *out = fromkey(leaf->is3node ? leaf->rdata : leaf->ldata);
+   return true;
+}
+
+bool pop_min(tree * root, float * out) {
+   return popextreme(root, true, out);
+}
+
+bool pop_max(tree * root, float * out) {
+   return popextreme(root, false, out);
+}
+
+/*
+ * Each dead copy exhumed here is one the sweep would have removed anyway,
+ * so a peek only ever does work that earlier lazy rmvals put off, and
+ * only for the values it has to look past.
+ */
+static node * liveleaf(tree * t, bool leftmost) {
+   node * leaf = extremeleaf(t, leftmost);
+   while (leaf != NULL && t->graves != NULL && t->graves->count > 0) {
+      sortkey k = leftmost || !leaf->is3node ? leaf->ldata : leaf->rdata;
+      if (buried(t, k) == 0)
+         break;
+      exhume(t, k);
+      leaf = extremeleaf(t, leftmost);
+   }
+   return leaf;
+}
+
+static node * extremeleaf(tree * t, bool leftmost) {
+   node ** cached = leftmost ? &t->minleaf : &t->maxleaf;
+   node * n = t->root;
+   if (!n->is2node && !n->is3node)
+      return NULL;
+   if (*cached == NULL) {
+      while (n->left != NULL)
+         n = leftmost ? n->left : n->right;
+      *cached = n;
+   }
+   return *cached;
+}
+
+/*
+ * A 3-node leaf just drops the value. A 2-node leaf is emptied and handed
+ * straight to repair, the same as mrmval does after its swap, but without
+ * the descent. The finger only goes stale if something was merged.
+ * Root leaves and copy-on-write trees go through rmval instead.
+ */
+static bool popextreme(tree * t, bool leftmost, float * out) {
+   if (!(leftmost ? tree_min(t, out) : tree_max(t, out)))
+      return false;
+   node * leaf = leftmost ? t->minleaf : t->maxleaf;
+   if (t->snaps != NULL || leaf->parent == NULL) {
+      rmval(*out, t);
+      return true;
+   }
+   if (t->filter != NULL)
+      filterdrop(t, 1);
+   stamp = t->epoch;
+   pool = t->mem;
+   if (leaf->is3node) {
+      if (leftmost)
+         leaf->ldata = leaf->rdata;
+      leaf->rdata = 0;
+      leaf->is3node = false;
+      leaf->is2node = true;
+      return true;
+   }
+   leaf->ldata = 0;
+   leaf->is2node = false;
+   t->last.depth = 0;
+   node * new_root = repair(leaf, t);
+   if (new_root != NULL) {
+      t->root = new_root;
+      modmem(DEL, new_root->parent);
+      new_root->parent = NULL;
+   }
+   return true;
+}
+
+/*
+ * The same removal as rmval, but shaped around a single descent. Whenever
+ * the next node down is a 2-node with a 3-node neighbour, a key is rotated
+ * into it before stepping down, so the node reached at the bottom can
+ * usually give up a key without any repair at all. What can't be fixed on
+ * the way down (2-node with only 2-node neighbours) is merged on the way
+ * back up, using the recorded path rather than parent pointers and
+ * discern_childhood. A true single pass isn't possible for a 2-3 tree:
+ * merging two 2-nodes preemptively would need a 4-node.
+ * The path copier only knows mrmval's access pattern, so while snapshots
+ * are alive this defers to rmval.
+ */
+void rmval_topdown(float val, tree * root) {
+   krmval_topdown(tokey(val), root);
+}
+
+static void krmval_topdown(sortkey val, tree * root) {
+   node * path[128];
+   int via[128]; //Which child of path[i] the descent took.
+   sortkey keys[2];
+   node * kids[3];
+   int depth = 0;
+   node * found = NULL; //Internal node whose key gets the predecessor.
+   int found_slot = 0;
+   node * n = root->root;
+   if (root->snaps != NULL || n->left == NULL || root->pending_cap > 0 ||
+       root->graves != NULL) {
+      krmval(val, root);
+      return;
+   }
+   stamp = root->epoch;
+   pool = root->mem;
+   root->last.depth = 0;
+   while (n->left != NULL) {
+      int nkeys = unpack(n, keys, kids);
+      int next = nkeys;
+      if (found == NULL) {
+         int i = 0;
+         for (i = 0; i < nkeys; i++) {
+            if (keys[i] == val) {
+               //Replace val with the largest value to its left.
+               found = n;
+               found_slot = i;
+               next = i;
+               break;
+            }
+            if (val < keys[i]) {
+               next = i;
+               break;
+            }
+         }
+      }
+      node * child = kids[next];
+      if (child->is2node) {
+         //Borrowing from the right would pull found's key down, so only
+         //borrow leftwards once the key has been found here.
+         if (next > 0 && kids[next - 1]->is3node)
+            rotate(n, next - 1, next);
+         else if (next < nkeys && kids[next + 1]->is3node && n != found)
+            rotate(n, next + 1, next);
+      }
+      path[depth] = n;
+      via[depth++] = next;
+      n = child;
+   }
+   //n is now the leaf to take a value from.
+   int nkeys = unpack(n, keys, kids);
+   if (found != NULL) {
+      sortkey pred = keys[nkeys - 1];
+      if (found_slot == 0)
+         found->ldata = pred;
+      else
+         found->rdata = pred;
+   }
+   else if (keys[0] == val)
+      keys[0] = keys[1];
+   else if (nkeys < 2 || keys[1] != val)
+      return; //Not in the tree.
+   if (root->filter != NULL)
+      filterdrop(root, 1);
+   nkeys--;
+   pack(n, keys, kids, nkeys);
+   //Only merges are left to do: walk back up while a node is empty.
+   node * orphan = NULL; //The lone child of the empty node n.
+   while (nkeys == 0) {
+      node * parent = path[--depth];
+      int at = via[depth];
+      sortkey pkeys[2], skeys[2];
+      node * pkids[3], * skids[3];
+      int pn = unpack(parent, pkeys, pkids);
+      int i = 0;
+      //A neighbour that is still a 3-node lends a key and a child.
+      if (at > 0 && pkids[at - 1]->is3node) {
+         node * sib = pkids[at - 1];
+         (void)unpack(sib, skeys, skids);
+         sortkey nk[1] = {pkeys[at - 1]};
+         node * nc[2] = {skids[2], orphan};
+         pkeys[at - 1] = skeys[1];
+         pack(n, nk, nc, 1);
+         pack(sib, skeys, skids, 1);
+         pack(parent, pkeys, pkids, pn);
+         return;
+      }
+      if (at < pn && pkids[at + 1]->is3node) {
+         node * sib = pkids[at + 1];
+         (void)unpack(sib, skeys, skids);
+         sortkey nk[1] = {pkeys[at]};
+         node * nc[2] = {orphan, skids[0]};
+         pkeys[at] = skeys[0];
+         pack(n, nk, nc, 1);
+         pack(sib, skeys + 1, skids + 1, 1);
+         pack(parent, pkeys, pkids, pn);
+         return;
+      }
+      //Otherwise fold the empty node and a separator into a 2-node
+      //neighbour, and take both out of the parent.
+      int sep = at > 0 ? at - 1 : at;
+      node * sib = pkids[at > 0 ? at - 1 : at + 1];
+      (void)unpack(sib, skeys, skids);
+      sortkey mk[2];
+      node * mc[3];
+      if (at > 0) {
+         mk[0] = skeys[0];
+         mk[1] = pkeys[sep];
+         mc[0] = skids[0];
+         mc[1] = skids[1];
+         mc[2] = orphan;
+      }
+      else {
+         mk[0] = pkeys[sep];
+         mk[1] = skeys[0];
+         mc[0] = orphan;
+         mc[1] = skids[0];
+         mc[2] = skids[1];
+      }
+      pack(sib, mk, mc, 2);
+      if (root->minleaf == n)
+         root->minleaf = sib;
+      if (root->maxleaf == n)
+         root->maxleaf = sib;
+      modmem(DEL, n);
+      for (i = sep; i < pn - 1; i++)
+         pkeys[i] = pkeys[i + 1];
+      for (i = at; i < pn; i++)
+         pkids[i] = pkids[i + 1];
+      nkeys = --pn;
+      n = parent;
+      if (nkeys > 0)
+         pack(parent, pkeys, pkids, pn);
+      else if (depth == 0) { //The root emptied out: its child takes over.
+         root->root = pkids[0];
+         pkids[0]->parent = NULL;
+         modmem(DEL, parent);
+      }
+      else
+         orphan = pkids[0];
+      if (depth == 0)
+         break;
+   }
+}
+
+static int unpack(node * n, sortkey * keys, node ** kids) {
+   keys[0] = n->ldata;
+   keys[1] = n->rdata;
+   kids[0] = n->left;
+   if (n->is3node) {
+      kids[1] = n->middle;
+      kids[2] = n->right;
+      return 2;
+   }
+   kids[1] = n->right;
+   kids[2] = NULL;
+   return n->is2node ? 1 : 0;
+}
+
+static void pack(node * n, const sortkey * keys, node ** kids, int nkeys) {
+   int i = 0;
+   n->ldata = nkeys > 0 ? keys[0] : 0;
+   n->rdata = nkeys > 1 ? keys[1] : 0;
+   n->left = kids[0];
+   n->middle = nkeys > 1 ? kids[1] : NULL;
+   n->right = nkeys > 0 ? kids[nkeys] : NULL;
+   n->is2node = nkeys == 1;
+   n->is3node = nkeys == 2;
+   for (i = 0; i <= nkeys; i++)
+      if (kids[i] != NULL)
+         kids[i]->parent = n;
+}
+
+static void rotate(node * parent, int from, int to) {
+   sortkey pkeys[2], fkeys[2], tkeys[2];
+   node * pkids[3], * fkids[3], * tkids[3];
+   int pn = unpack(parent, pkeys, pkids);
+   (void)unpack(pkids[from], fkeys, fkids);
+   (void)unpack(pkids[to], tkeys, tkids);
+   if (from < to) { //Lender on the left: its largest key goes up.
+      tkeys[1] = tkeys[0];
+      tkeys[0] = pkeys[from];
+      tkids[2] = tkids[1];
+      tkids[1] = tkids[0];
+      tkids[0] = fkids[2];
+      pkeys[from] = fkeys[1];
+      pack(pkids[from], fkeys, fkids, 1);
+   }
+   else { //Lender on the right: its smallest key goes up.
+      tkeys[1] = pkeys[to];
+      tkids[2] = fkids[0];
+      pkeys[to] = fkeys[0];
+      pack(pkids[from], fkeys + 1, fkids + 1, 1);
+   }
+   pack(pkids[to], tkeys, tkids, 2);
+   pack(parent, pkeys, pkids, pn);
+}
+
+/*
+ * Range removal by splitting rather than one rmval per value: cut the tree
+ * at lo, cut the upper half again at hi, throw the middle piece away and
+ * join what is left. Cutting and joining only rebalance along the two
+ * boundary paths, so this is O(log n) plus the nodes freed.
+ * Snapshots may still be reading the middle piece, so while any are alive
+ * this falls back to removing the values one at a time.
+ */
+uint64_t rmval_range(float lo, float hi, tree * root) {
+   return krmval_range(tokey(lo), tokey(hi), root);
+}
+
+static uint64_t krmval_range(sortkey lo, sortkey hi, tree * root) {
+   replay(root);
+   node * top_node = root->root;
+   uint64_t removed = 0;
+   if (hi < lo || (!top_node->is2node && !top_node->is3node))
+      return 0;
+   if (root->snaps != NULL) {
+      uint64_t cap = 64, i = 0;
+      sortkey * vals = malloc(sizeof(sortkey) * cap);
+      collect(top_node, lo, hi, &vals, &removed, &cap);
+      for (i; i < removed; i++)
+         (void)kremove(vals[i], root);
+      free(vals);
+   }
+   else
+      removed = cutrange(lo, hi, root);
+   //Dead copies in the range went with the rest, but were already
+   //counted as gone.
+   removed -= unbury(root, lo, hi);
+   if (root->filter != NULL)
+      filterdrop(root, removed);
+   return removed;
+}
+
+static uint64_t cutrange(sortkey lo, sortkey hi, tree * root) {
+   node * top_node = root->root;
+   stamp = root->epoch;
+   pool = root->mem;
+   root->last.depth = 0;
+   root->minleaf = root->maxleaf = NULL;
+   int height = 0;
+   node * n = top_node;
+   for (; n->left != NULL; n = n->left)
+      height++;
+   piece below, rest, doomed, above;
+   cut(top_node, height, lo, false, &below, &rest);
+   cut(rest.root, rest.height, hi, true, &doomed, &above);
+   uint64_t removed = freesub(doomed.root);
+   if (below.root != NULL && above.root != NULL) {
+      //Joining needs a key between the halves. Borrow above's smallest.
+      tree upper = *root;
+      upper.pending_cap = 0;
+      upper.filter = NULL;
+      for (n = above.root; n->left != NULL; n = n->left)
+         ;
+      sortkey key = n->ldata;
+      above.root->parent = NULL;
+      upper.root = above.root;
+      (void)kremove(key, &upper);
+      above.root = upper.root;
+      if (!above.root->is2node && !above.root->is3node) {
+         modmem(DEL, above.root);
+         above.root = NULL;
+         above.height = -1;
+      }
+      else
+         for (above.height = 0, n = above.root; n->left != NULL;
+              n = n->left)
+            above.height++;
+      below = join(below, key, above);
+   }
+   else if (below.root == NULL)
+      below = above;
+   root->root = below.root != NULL ? below.root : modmem(GET, NULL);
+   root->root->parent = NULL;
+   return removed;
+}
+
+/*
+ * Walks down toward the pivot. Every node on the way is dissolved: the
+ * subtrees to the pivot's left are joined onto lo and those to its right
+ * onto hi, with the node's own keys as the glue. Heights only grow along
+ * the way, so all the joins together cost O(height).
+ */
+static void cut(node * n, int height, sortkey pivot, bool inclusive,
+                piece * lo, piece * hi) {
+   if (n == NULL) {
+      lo->root = hi->root = NULL;
+      lo->height = hi->height = -1;
+      return;
+   }
+   piece a = {n->left, height - 1};
+   piece m = {n->middle, height - 1};
+   piece c = {n->right, height - 1};
+   sortkey k1 = n->ldata;
+   sortkey k2 = n->rdata;
+   bool three = n->is3node;
+   bool k1_left = inclusive ? k1 <= pivot : k1 < pivot;
+   bool k2_left = inclusive ? k2 <= pivot : k2 < pivot;
+   piece l, r;
+   modmem(DEL, n);
+   if (!three) {
+      if (k1_left) {
+         cut(c.root, c.height, pivot, inclusive, &l, hi);
+         *lo = join(a, k1, l);
+      }
+      else {
+         cut(a.root, a.height, pivot, inclusive, lo, &r);
+         *hi = join(r, k1, c);
+      }
+   }
+   else if (k2_left) {
+      cut(c.root, c.height, pivot, inclusive, &l, hi);
+      piece am = {make2(a.root, k1, m.root), height};
+      *lo = join(am, k2, l);
+   }
+   else if (k1_left) {
+      cut(m.root, m.height, pivot, inclusive, &l, &r);
+      *lo = join(a, k1, l);
+      *hi = join(r, k2, c);
+   }
+   else {
+      cut(a.root, a.height, pivot, inclusive, lo, &r);
+      piece mc = {make2(m.root, k2, c.root), height};
+      *hi = join(r, k1, mc);
+   }
+}
+
+static piece join(piece a, sortkey key, piece b) {
+   piece joined;
+   sortkey promoted = 0;
+   node * extra = NULL;
+   if (a.height == b.height) {
+      joined.root = make2(a.root, key, b.root);
+      joined.height = a.height + 1;
+      return joined;
+   }
+   if (a.height > b.height) {
+      joined = a;
+      extra = graftright(a.root, a.height, key, b, &promoted);
+      if (extra != NULL)
+         joined.root = make2(a.root, promoted, extra);
+   }
+   else {
+      joined = b;
+      extra = graftleft(b.root, b.height, key, a, &promoted);
+      if (extra != NULL)
+         joined.root = make2(extra, promoted, b.root);
+   }
+   if (extra != NULL)
+      joined.height++;
+   joined.root->parent = NULL;
+   return joined;
+}
+
+/*
+ * Same overflow handling as minsert, but a whole subtree comes in along
+ * with the key: a 2-node just absorbs both, a 3-node keeps its left half
+ * and gives its right half plus the newcomers to a new sibling.
+ */
+static node * graftright(node * n, int height, sortkey key, piece sub,
+                         sortkey * promoted) {
+   if (height > sub.height + 1) {
+      node * extra = graftright(n->right, height - 1, key, sub, &key);
+      if (extra == NULL)
+         return NULL;
+      sub.root = extra;
+   }
+   if (sub.root != NULL)
+      sub.root->parent = n;
+   if (n->is2node) {
+      n->middle = n->right;
+      n->rdata = key;
+      n->right = sub.root;
+      n->is2node = false;
+      n->is3node = true;
+      return NULL;
+   }
+   node * sibling = make2(n->right, key, sub.root);
+   *promoted = n->rdata;
+   n->right = n->middle;
+   n->middle = NULL;
+   n->rdata = 0;
+   n->is3node = false;
+   n->is2node = true;
+   return sibling;
+}
+
+static node * graftleft(node * n, int height, sortkey key, piece sub,
+                        sortkey * promoted) {
+   if (height > sub.height + 1) {
+      node * extra = graftleft(n->left, height - 1, key, sub, &key);
+      if (extra == NULL)
+         return NULL;
+      sub.root = extra;
+   }
+   if (sub.root != NULL)
+      sub.root->parent = n;
+   if (n->is2node) {
+      n->middle = n->left;
+      n->rdata = n->ldata;
+      n->ldata = key;
+      n->left = sub.root;
+      n->is2node = false;
+      n->is3node = true;
+      return NULL;
+   }
+   node * sibling = make2(sub.root, key, n->left);
+   *promoted = n->ldata;
+   n->left = n->middle;
+   n->ldata = n->rdata;
+   n->middle = NULL;
+   n->rdata = 0;
+   n->is3node = false;
+   n->is2node = true;
+   return sibling;
+}
+
+static node * make2(node * l, sortkey key, node * r) {
+   node * n = modmem(GET, NULL);
+   n->left = l;
+   n->right = r;
+   n->ldata = key;
+   n->is2node = true;
+   if (l != NULL)
+      l->parent = n;
+   if (r != NULL)
+      r->parent = n;
+   return n;
+}
+
+static uint64_t freesub(node * n) {
+   if (n == NULL)
+      return 0;
+   uint64_t count = n->is3node ? 2 : 1;
+   count += freesub(n->left);
+   count += freesub(n->middle);
+   count += freesub(n->right);
+   modmem(DEL, n);
+   return count;
+}
+
+static void collect(node * n, sortkey lo, sortkey hi, sortkey ** vals,
+                    uint64_t * len, uint64_t * cap) {
+   if (n == NULL || (!n->is2node && !n->is3node))
+      return;
+   sortkey keys[2] = {n->ldata, n->rdata};
+   node * kids[3] = {n->left, n->is3node ? n->middle : n->right, n->right};
+   int nkeys = n->is3node ? 2 : 1;
+   int i = 0;
+   for (i; i <= nkeys; i++) {
+      //Subtree i holds values between keys[i - 1] and keys[i].
+      if ((i == nkeys || lo <= keys[i]) && (i == 0 || keys[i - 1] <= hi))
+         collect(kids[i], lo, hi, vals, len, cap);
+      if (i < nkeys && lo <= keys[i] && keys[i] <= hi) {
+         if (*len == *cap) {
+            *cap *= 2;
+            *vals = realloc(*vals, sizeof(sortkey) * *cap);
+         }
+         (*vals)[(*len)++] = keys[i];
+      }
+   }
 }
 
 //Discerns which child the node is.
@@ -710,11 +2466,181 @@ direction discern_childhood(node * child, node * parent) {
    }
 }
 
+/*
+ * Hands out a view of the tree as it is right now. Bumping the epoch makes
+ * every existing node "old", so the next write to any of them copies it
+ * first and the snapshot's root-to-leaf paths stay untouched. A lazy
+ * tree's tombstones are copied rather than swept: one copy of the table,
+ * and no work on the nodes.
+ */
+snapshot * tree_snapshot(tree * root) {
+   replay(root);
+   snapshot * snap = malloc(sizeof(snapshot));
+   snap->root = root->root;
+   snap->graves = copygraves(root->graves);
+   snap->epoch = root->epoch++;
+   snap->owner = root;
+   snap->next = root->snaps;
+   root->snaps = snap;
+   return snap;
+}
+
+bool snapshot_contains(float val, snapshot * snap) {
+   sortkey k = tokey(val);
+   uint64_t dead = 0;
+   if (snap->graves != NULL)
+      dead = snap->graves->slots[findgrave(snap->graves, k)].dead;
+   return dead == 0 ? ksearch(k, snap->root) :
+                      occurrences(snap->root, k) > dead;
+}
+
+/*
+ * Unlinks the snapshot from its tree and recycles whatever only it could
+ * still see.
+ */
+void tree_release(snapshot * snap) {
+   tree * t = snap->owner;
+   snapshot ** curr = &t->snaps;
+   while (*curr != snap)
+      curr = &(*curr)->next;
+   *curr = snap->next;
+   delgraves(snap->graves);
+   free(snap);
+   pool = t->mem;
+   reclaim(t);
+}
+
+/*
+ * Path copying. Readers never follow parent pointers, so a copy may adopt
+ * the old node's children (fixing their parent pointers) without
+ * disturbing any snapshot that still reaches them through the old node.
+ * Callers must own the parent before the child, i.e. work top-down.
+ */
+static node * own(node * n, tree * t) {
+   if (n->epoch == t->epoch)
+      return n;
+   node * copy = modmem(GET, NULL);
+   *copy = *n;
+   copy->epoch = t->epoch;
+   if (copy->left != NULL)
+      copy->left->parent = copy;
+   if (copy->middle != NULL)
+      copy->middle->parent = copy;
+   if (copy->right != NULL)
+      copy->right->parent = copy;
+   if (t->minleaf == n)
+      t->minleaf = copy;
+   if (t->maxleaf == n)
+      t->maxleaf = copy;
+   node * parent = copy->parent;
+   if (parent == NULL)
+      t->root = copy;
+   else if (parent->left == n)
+      parent->left = copy;
+   else if (parent->middle == n)
+      parent->middle = copy;
+   else
+      parent->right = copy;
+   if (t->retired_ndx == t->retired_len) {
+      t->retired_len = t->retired_len ? t->retired_len * 2 : 64;
+      t->retired = realloc(t->retired, sizeof(retiree) * t->retired_len);
+   }
+   t->retired[t->retired_ndx].n = n;
+   t->retired[t->retired_ndx].epoch = t->epoch;
+   t->retired_ndx++;
+   return copy;
+}
+
+//Follows the exact path insert and minsert take, copying as it goes.
+//Splits only ever write to nodes on this path (and to fresh nodes).
+static void cow_insert(sortkey val, tree * t) {
+   node * n = own(t->root, t);
+   while (n->left || n->right) {
+      if (val < n->ldata)
+         n = n->left;
+      else if (n->middle != NULL && val < n->rdata)
+         n = n->middle;
+      else
+         n = n->right;
+      n = own(n, t);
+   }
+}
+
+/*
+ * Follows mrmval's dive to the swap leaf, copying the path. Underflow
+ * repair also writes to the siblings of every node that can empty out, so
+ * walking back up from the leaf, those get copied too: a level can only
+ * empty if it is a 2-node, and the repair only climbs past a 2-node parent.
+ */
+static void cow_remove(sortkey val, tree * t) {
+   node * path[128];
+   int depth = 0;
+   bool found = false;
+   direction val_to_switch = middle;
+   node * curr = t->root;
+   if (curr->left == NULL) {
+      (void)own(curr, t);
+      return;
+   }
+   //Same walk as mrmval's first loop, minus the writes.
+   while (curr != NULL) {
+      path[depth++] = curr;
+      if (curr->ldata == val || (curr->is3node && (curr->rdata == val))) {
+         found = true;
+         val_to_switch = curr->ldata == val ? left : right;
+         curr = val_to_switch == left ? curr->left : curr->right;
+      }
+      else if (!found) {
+         if (val < curr->ldata)
+            curr = curr->left;
+         else if (curr->is3node && val < curr->rdata)
+            curr = curr->middle;
+         else
+            curr = curr->right;
+      }
+      else
+         curr = val_to_switch == left ? curr->right : curr->left;
+   }
+   if (!found)
+      return;
+   int i = 0;
+   for (i = 0; i < depth; i++)
+      path[i] = own(path[i], t);
+   for (i = depth - 1; i > 0 && path[i]->is2node; i--) {
+      node * parent = path[i - 1];
+      if (parent->left != path[i])
+         (void)own(parent->left, t);
+      if (parent->middle != NULL && parent->middle != path[i])
+         (void)own(parent->middle, t);
+      if (parent->right != path[i])
+         (void)own(parent->right, t);
+   }
+}
+
+/*
+ * Retirees are appended in epoch order, so the reclaimable ones are always
+ * a prefix. A node retired in epoch e was last visible to snapshots older
+ * than e.
+ */
+static void reclaim(tree * t) {
+   uint64_t oldest = UINT64_MAX;
+   snapshot * snap = t->snaps;
+   for (; snap != NULL; snap = snap->next)
+      if (snap->epoch < oldest)
+         oldest = snap->epoch;
+   uint64_t i = 0;
+   while (i < t->retired_ndx && t->retired[i].epoch <= oldest)
+      modmem(DEL, t->retired[i++].n);
+   memmove(t->retired, t->retired + i,
+           sizeof(retiree) * (t->retired_ndx - i));
+   t->retired_ndx -= i;
+}
+
 /*
  * Swaps 'val' into the 2-node in such a way that 
  * the left value is smaller than (or equal to) the right one.
  */
-static void simpleswap(float val, node * n) {
+static void simpleswap(sortkey val, node * n) {
    if (val > n->ldata)
       n->rdata = val;
    else {
@@ -729,7 +2655,7 @@ static void simpleswap(float val, node * n) {
  * the values in the node are in sorted order (from left to right).
  * Should only be used on filled up nodes.
  */
-static void swapsort(float val, node * n) {
+static void swapsort(sortkey val, node * n) {
       if (val > n->ldata && val <= n->rdata) {
          n->mdata = val;
       }
@@ -759,59 +2685,66 @@ static void swapsort(float val, node * n) {
  * if f is set to FREE.
  */
 static node * modmem(fetch_style f, node * node_to_clear) {
-   static uint64_t buf_size = 8192; //Beginning size
-   //The current memory buffer utilised by the program.
-   static node * mem_buf = NULL;
-   static uint64_t buf_ndx = 0; 
-   //Contains all memory buffers allocated by the program.
-   //This obviates the use of "realloc", which can render all
-   //tree node pointers useless.
-   static node ** buffers = NULL;
-   static uint64_t buffers_len = 8192;
-   static uint64_t buffers_ndx = 0;
-   //The buffer which stores pointers to nodes cleared by the rmval
-   //function.
-   static node ** delbuf = NULL;
-   static uint64_t delbuf_len = 8192;
-   static uint64_t delbuf_ndx = 0;
+   allocator * a = pool;
+   //The shared pool keeps its own slabs, so there is nothing to FREE.
+   if (a->pooled) {
+      if (f == GET) {
+         node * n = nodepool_get();
+         n->epoch = stamp;
+         a->live++;
+         return n;
+      }
+      if (f == DEL && node_to_clear != NULL) {
+         memset(node_to_clear, '\0', sizeof(node));
+         nodepool_put(node_to_clear);
+         a->live--;
+      }
+      return NULL;
+   }
    //Initialize first-time use of mem_buf, as well as aux. buffers.
-   if (mem_buf == NULL) {
-      mem_buf = malloc(sizeof(node) * buf_size);
-      memset(mem_buf, '\0', sizeof(node) * buf_size);
+   if (a->mem_buf == NULL && f != FREE) {
+      a->buf_size = 8192; //Beginning size
+      a->mem_buf = malloc(sizeof(node) * a->buf_size);
+      memset(a->mem_buf, '\0', sizeof(node) * a->buf_size);
       //I am over-allocating a *lot* here, but that will mean far fewer
       //reallocs for this array of node pointers.
-      buffers = malloc(sizeof(node *) * buffers_len);
-      buffers[0] = mem_buf;
-      delbuf = malloc(sizeof(node *) * delbuf_len);
+      //This obviates the use of "realloc", which can render all
+      //tree node pointers useless.
+      a->buffers_len = 8192;
+      a->buffers = malloc(sizeof(node *) * a->buffers_len);
+      a->buffers[0] = a->mem_buf;
+      a->delbuf_len = 8192;
+      a->delbuf = malloc(sizeof(node *) * a->delbuf_len);
    }
    //Index into the buffer that provides data to pointers.
    if (f == GET) {
       //Can't change the index after returning, so save the old value.
-      uint64_t temp = 0;//buf_ndx++;
+      uint64_t temp = 0;
       //Return a previously cleared node pointer if there are any left in the
       //buffer filled with them.
-      if (delbuf_ndx > 0) {
-         return delbuf[--delbuf_ndx];
-      }
-      temp = buf_ndx++;
-      if (buf_ndx > buf_size) {
-         //uint64_t tmp_sz = buf_size;
-         buf_size *= 2;
-         mem_buf = malloc(sizeof(node) * buf_size);
-         memset(mem_buf, '\0', sizeof(node) * buf_size);
+      if (a->delbuf_ndx > 0) {
+         a->delbuf[a->delbuf_ndx - 1]->epoch = stamp;
+         return a->delbuf[--a->delbuf_ndx];
+      }
+      temp = a->buf_ndx++;
+      if (a->buf_ndx > a->buf_size) {
+         a->buf_size *= 2;
+         a->mem_buf = malloc(sizeof(node) * a->buf_size);
+         memset(a->mem_buf, '\0', sizeof(node) * a->buf_size);
          //Prefix increment used here because the first element is always
          //full.
-         buffers[++buffers_ndx] = mem_buf;
-         if (buffers_ndx == buffers_len) {
-            buffers_len *= 2;
+         a->buffers[++a->buffers_ndx] = a->mem_buf;
+         if (a->buffers_ndx == a->buffers_len) {
+            a->buffers_len *= 2;
             //Not going to bother using memset here, as the memory is
             //never read from before it's allocated.
-            buffers = realloc(buffers, sizeof(node *) * buffers_len);
+            a->buffers = realloc(a->buffers, sizeof(node *) * a->buffers_len);
          }
          temp = 0;
-         buf_ndx = 1;
+         a->buf_ndx = 1;
       }
-      return mem_buf + temp;
+      a->mem_buf[temp].epoch = stamp;
+      return a->mem_buf + temp;
    }
    //A call to rmval was made, clear up the passed in address's data
    //and add its address to the "free" buffer.
@@ -820,36 +2753,27 @@ static node * modmem(fetch_style f, node * node_to_clear) {
          fprintf(stderr, "Please pass in a valid address to clear.\n");
          return NULL; //Perhaps ret a value other than NULL for an error...
       }
-      delbuf[delbuf_ndx++] = node_to_clear;
+      a->delbuf[a->delbuf_ndx++] = node_to_clear;
       memset(node_to_clear, '\0', sizeof(node));
-      if (delbuf_ndx == delbuf_len) {
-         delbuf_len *= 2;
-         delbuf = realloc(delbuf, sizeof(node *) * delbuf_len);
+      if (a->delbuf_ndx == a->delbuf_len) {
+         a->delbuf_len *= 2;
+         a->delbuf = realloc(a->delbuf, sizeof(node *) * a->delbuf_len);
       }
       return NULL;
    }
    //Return everything to its initial state, free all buffers.
    else if (f == FREE) {
       uint64_t i = 0;
-      for (i; i <= buffers_ndx; i++) {
-         memset(buffers[i], '\0', sizeof(node) * 8192 * (i + 1));
-         free(buffers[i]);
-      }
-      memset(buffers, '\0', sizeof(node *) * buffers_len);
-      free(buffers);
-      memset(delbuf, '\0', sizeof(node *) * delbuf_len);
-      free(delbuf);
-      buf_size = 8192;
-      mem_buf = NULL;
-      buf_ndx = 0;
-      buffers = NULL;
-      buffers_len = 8192;
-      buffers_ndx = 0;
-      delbuf = NULL;
-      delbuf_len = 8192;
-      delbuf_ndx = 0;
+      if (a->mem_buf == NULL)
+         return NULL;
+      for (i; i <= a->buffers_ndx; i++)
+         free(a->buffers[i]);
+      free(a->buffers);
+      free(a->delbuf);
+      memset(a, '\0', sizeof(allocator));
       return NULL;
    }
+   return NULL;
 }
 bool isvalid(node * curr) {
    bool valid = true; //I'm feeling optimistic.
@@ -859,7 +2783,8 @@ bool isvalid(node * curr) {
    if (!valid)
       return valid;
    if (curr->ldata > curr->rdata && curr->is3node) {
-      fprintf(stderr, "curr ldata: %f, rdata: %f\n", curr->ldata, curr->rdata);
+      fprintf(stderr, "curr ldata: %f, rdata: %f\n", fromkey(curr->ldata),
+              fromkey(curr->rdata));
       fprintf(stderr, "Should never happen\n");
       return false;
    }
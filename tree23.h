@@ -2,6 +2,9 @@
  * "tree23.h", by Sean Soderman
  * Specification of 2-3 tree functions.
  */
+#ifndef TREE23_H
+#define TREE23_H
+
 #ifndef STDBOOL_H
 #include <stdbool.h>
 #endif
@@ -11,6 +14,14 @@
 #endif
 
 
+/*
+ * How the tree stores a float: its bits, remapped so that comparing them as
+ * unsigned integers orders them the way the floats are ordered. Unlike
+ * comparing floats, this is a total order, NaNs included:
+ * -NaN < -inf < ... < -0 < +0 < ... < +inf < +NaN. So -0 and +0 are two
+ * different keys, and a NaN can be stored and found again like any other.
+ */
+typedef uint32_t sortkey;
 
 /*
  * Defines a node ptr. mid_right and mdata are both 
@@ -23,32 +34,214 @@ typedef struct n {
    struct n * mid_right;
    struct n * right;
    struct n * parent;
-   float ldata;
-   float mdata;
-   float rdata;
+   sortkey ldata;
+   sortkey mdata;
+   sortkey rdata;
+   //The tree epoch this node was written in. Nodes from an older epoch may
+   //still be visible to a snapshot, so they are copied before being changed.
+   uint64_t epoch;
    bool is2node;
    bool is3node;
    bool is4node;
 }node;
 
+#ifndef FINGER_DEPTH
+#define FINGER_DEPTH 64
+#endif
+
+/*
+ * The path the last insert took, root first, along with the range of
+ * values [lo, hi) each node on it is responsible for. The next insert
+ * climbs only as far as the first node whose range holds its value and
+ * descends from there, so runs of nearby keys skip most of the descent.
+ * dir is which child of the previous node each node is.
+ */
+typedef struct fp {
+   node * path[FINGER_DEPTH];
+   sortkey lo[FINGER_DEPTH];
+   sortkey hi[FINGER_DEPTH];
+   int dir[FINGER_DEPTH];
+   int depth; //0 when nothing is remembered.
+}finger;
+
+/*
+ * A pending insert (or delete, if del is set) waiting in a buffered tree.
+ */
+typedef struct m {
+   sortkey key;
+   bool del;
+}message;
+
 typedef struct t {
    node * root;
    //uint64_t size;
+   //Bumped every time a snapshot is taken.
+   uint64_t epoch;
+   //Live snapshots, newest first.
+   struct s * snaps;
+   //Nodes replaced by path copying that some snapshot may still be reading.
+   struct r * retired;
+   uint64_t retired_len;
+   uint64_t retired_ndx;
+   //Set by create(). Clear it to make every insert descend from the root.
+   bool fingers;
+   finger last;
+   //The leaves holding the smallest and largest values, or NULL if they
+   //have to be looked up again.
+   node * minleaf;
+   node * maxleaf;
+   //Buffered trees only: writes not yet applied. The newest ones, from
+   //pending_sorted on, are in arrival order. Everything before that is a
+   //stack of runs sorted by key and, for equal keys, by arrival, oldest
+   //run first, each one longer than all the newer ones put together.
+   //pending_cap is 0 for an unbuffered tree.
+   message * pending;
+   uint32_t pending_len;
+   uint32_t pending_cap;
+   uint32_t pending_sorted;
+   //Where each run ends.
+   uint32_t run_end[32];
+   int runs;
+   //Room for the newer of two runs being merged: half the buffer.
+   message * merge_space;
+   //This tree's node allocator. Trees share nothing, pooled ones aside, so
+   //different trees may be written by different threads at once.
+   struct a * mem;
+   //Approximate membership of the values above, checked by contains before
+   //it descends. NULL unless tree_filter turned it on.
+   struct b * filter;
+   //Values rmval has deleted but left in the nodes. NULL unless tree_lazy
+   //turned tombstones on.
+   struct g * graves;
 }tree;
 
+/*
+ * A read-only, point-in-time view of a tree. While any snapshot is alive,
+ * insert and rmval copy the root-to-leaf nodes they touch instead of
+ * changing them, so the snapshot's nodes are never written to. Parent
+ * pointers inside a snapshot are not kept up to date, so only top-down
+ * functions (search, treeprint) may be used on its root.
+ */
+typedef struct s {
+   node * root;
+   //The tombstones of a lazy tree when the snapshot was taken, if it had
+   //any. search and treeprint don't know about them; snapshot_contains
+   //does.
+   struct g * graves;
+   uint64_t epoch;
+   struct t * owner;
+   struct s * next;
+}snapshot;
+
+//Converts a float to the key the tree stores for it, and back.
+sortkey tokey(float val);
+float fromkey(sortkey k);
+
 //Simply creates and initializes a 2-3 tree.
 tree * create();
 
+//Creates a tree whose nodes come from the shared pool in nodepool.h rather
+//than from slabs of its own, so nodes one tree frees can be reused by
+//another, on any thread. Pooled trees may still be written at once.
+tree * create_pooled();
+
+//Creates a write-optimized tree: inserts and rmvals are queued in a
+//buffer of buflen messages, kept as a few sorted runs, and applied in key
+//order when it fills.
+tree * create_buffered(uint32_t buflen);
+
+//Applies every write still queued in a buffered tree, and sweeps out every
+//tombstone in a lazy one. Anything that reads nodes directly (treeprint,
+//isvalid, tree_export, snapshots) needs this first; the tree-level
+//functions do it themselves.
+void tree_flush(tree * root);
+
 //Deletes and clears all data set by the tree.
 void deltree(tree * root);
 
 //Inserts a value into the tree.
 void insert(float val, tree * root);
 
+//Inserts len values at once. Radix sorts vals in place (in key order)
+//first, so consecutive inserts walk down mostly the same path.
+void insert_batch(float * vals, uint64_t len, tree * root);
+
+//Builds the tree straight from len values in ascending order (values that
+//turn out not to be in key order get sorted first). Only an empty tree
+//with no live snapshots is built directly; anything else falls back to
+//insert_batch.
+void bulkload(float * vals, uint64_t len, tree * root);
+
 //Removes a value from the tree.
 void rmval(float val, tree * root);
 
+//Returns true if val is stored in the tree (or snapshot) rooted at root.
+bool search(float val, node * root);
+
+//Returns true if val is in the tree, counting writes still buffered.
+bool contains(float val, tree * root);
+
+//Puts a Bloom filter in front of contains, or takes it away. While it is
+//on, most lookups of missing values return without descending. It costs
+//about FILTER_BITS_PER_KEY bits per value and is rebuilt from the tree as
+//it grows or after many removals.
+void tree_filter(tree * root, bool on);
+
+//Makes rmval lazy, or makes it eager again if max_tombstones is 0. A lazy
+//rmval only marks a copy of the value dead: one descent to count its
+//copies, and no changes to the nodes. Each insert then sweeps LAZY_SWEEP
+//tombstones out of the nodes for good, and an rmval sweeps one only when
+//max_tombstones are already waiting. contains and insert see through
+//tombstones (inserting a dead value brings it back), tree_min, tree_max
+//and the pops remove just the dead copies they have to look past, and
+//rmval_range just the ones in its range. Anything that reads nodes
+//directly needs tree_flush first, which sweeps them all.
+void tree_lazy(tree * root, uint32_t max_tombstones);
+
+//Sweeps up to steps tombstones out of a lazy tree, for when it is idle.
+//This writes to the tree, so it must not run alongside anything else that
+//uses it. Returns how many tombstones are left.
+uint64_t tree_sweep(tree * root, uint64_t steps);
+
+//Prints how many nodes the tree is using, how many of its values are
+//tombstones, and, if it has a filter, the filter's memory use and false
+//positive rate so far.
+void tree_stats(tree * root);
+
+//Takes a snapshot of the tree's current contents. O(1), plus a copy of
+//the tombstone table if the tree is lazy and has any.
+snapshot * tree_snapshot(tree * root);
+
+//Returns true if val was in the tree when snap was taken, seeing through
+//the tree's tombstones the way contains does.
+bool snapshot_contains(float val, snapshot * snap);
+
+//Releases a snapshot, reclaiming any nodes only it was still using.
+void tree_release(snapshot * snap);
+
+//Stores the smallest (largest) value in *out. Returns false if the tree
+//is empty. O(1) while the cached leaf is still current.
+bool tree_min(tree * root, float * out);
+bool tree_max(tree * root, float * out);
+
+//Removes the smallest (largest) value, storing it in *out. Returns false
+//if the tree is empty. O(1) unless the leaf has to borrow or merge.
+bool pop_min(tree * root, float * out);
+bool pop_max(tree * root, float * out);
+
+//Removes a value from the tree in one descent that borrows from 3-node
+//siblings on the way down, recording its path instead of reading parent
+//pointers. Leaves the tree exactly as valid as rmval does.
+void rmval_topdown(float val, tree * root);
+
+//Removes every value v with lo <= v <= hi. Only the paths down to lo and
+//hi are rebalanced; everything between is freed wholesale.
+//Returns the number of values removed.
+uint64_t rmval_range(float lo, float hi, tree * root);
+
 //Prints all values of the tree out, in order, using a depth-first traversal.
 void treeprint(node * root);
 
 bool isvalid(node * curr);
+
+#endif
@@ -0,0 +1,983 @@
+/*
+ * "tree23.hpp", by Sean Soderman
+ * A header-only C++ version of the 2-3 tree, for any key type and
+ * comparator, with a std::set / std::map style interface.
+ *
+ * tree23<Key> is a set of unique keys; tree23<Key, Value> maps each key to
+ * a Value. Compare is called directly, so it is inlined the way a float
+ * comparison is in tree23.c. Nodes come from Alloc (rebound to the node
+ * type), so tree23_pool can hand them out from slabs like modmem does.
+ */
+#ifndef TREE23_HPP
+#define TREE23_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace tree23_detail {
+
+/*
+ * What every copy of a tree23_pool shares, rebound copies included: a
+ * slab chain and free list per object size, so a pool handed to a tree
+ * and the one get_allocator gives back are the same pool.
+ */
+struct pool_state {
+   struct size_class {
+      std::size_t size = 0;
+      std::vector<std::unique_ptr<std::max_align_t[]>> slabs;
+      std::size_t slab_len = 0;
+      std::size_t slab_ndx = 0;
+      void * free = nullptr;
+   };
+
+   //Few sizes are ever asked for, so a list beats a map here.
+   std::vector<std::unique_ptr<size_class>> classes;
+
+   size_class * find(std::size_t size) {
+      for (auto & c : classes)
+         if (c->size == size)
+            return c.get();
+      classes.emplace_back(new size_class);
+      classes.back()->size = size;
+      return classes.back().get();
+   }
+};
+
+} //namespace tree23_detail
+
+/*
+ * A node allocator in the style of modmem: single objects come from slabs
+ * that double in size, starting at 8192, and freed ones go on a free list
+ * for the next allocation. Copies and rebound copies share one pool, and
+ * objects of each size get slabs of their own within it.
+ */
+template <class T>
+class tree23_pool {
+   template <class U> friend class tree23_pool;
+   using state = tree23_detail::pool_state;
+
+   static_assert(alignof(T) <= alignof(std::max_align_t),
+                 "tree23_pool can't over-align its slabs");
+   //Room for the object or a free list link, rounded up so every slot in
+   //a slab stays aligned.
+   static constexpr std::size_t slot_size =
+      ((sizeof(T) > sizeof(void *) ? sizeof(T) : sizeof(void *)) +
+       alignof(std::max_align_t) - 1) /
+      alignof(std::max_align_t) * alignof(std::max_align_t);
+
+   std::shared_ptr<state> pool;
+   state::size_class * mine;
+
+public:
+   using value_type = T;
+   using propagate_on_container_copy_assignment = std::true_type;
+   using propagate_on_container_move_assignment = std::true_type;
+   using propagate_on_container_swap = std::true_type;
+
+   tree23_pool()
+      : pool(std::make_shared<state>()), mine(pool->find(slot_size)) {}
+   //Copied, never moved from, so a moved-from tree can still allocate.
+   tree23_pool(const tree23_pool &) = default;
+   template <class U>
+   tree23_pool(const tree23_pool<U> & other)
+      : pool(other.pool), mine(pool->find(slot_size)) {}
+
+   T * allocate(std::size_t n) {
+      if (n != 1)
+         return static_cast<T *>(::operator new(n * sizeof(T)));
+      state::size_class & c = *mine;
+      if (c.free != nullptr) {
+         void * got = c.free;
+         c.free = *static_cast<void **>(got);
+         return static_cast<T *>(got);
+      }
+      if (c.slab_ndx == c.slab_len) {
+         c.slab_len = c.slab_len == 0 ? 8192 : c.slab_len * 2;
+         c.slabs.emplace_back(new std::max_align_t[
+            (c.slab_len * slot_size + sizeof(std::max_align_t) - 1) /
+            sizeof(std::max_align_t)]);
+         c.slab_ndx = 0;
+      }
+      unsigned char * slab =
+         reinterpret_cast<unsigned char *>(c.slabs.back().get());
+      return reinterpret_cast<T *>(slab + slot_size * c.slab_ndx++);
+   }
+
+   void deallocate(T * p, std::size_t n) {
+      if (n != 1) {
+         ::operator delete(p);
+         return;
+      }
+      ::new (static_cast<void *>(p)) (void *)(mine->free);
+      mine->free = p;
+   }
+
+   template <class U>
+   bool operator==(const tree23_pool<U> & other) const {
+      return pool == other.pool;
+   }
+   template <class U>
+   bool operator!=(const tree23_pool<U> & other) const {
+      return !(*this == other);
+   }
+};
+
+namespace tree23_detail {
+
+//What a set stores, and how to get the key back out of it.
+template <class Key, class Value>
+struct kind {
+   using value_type = std::pair<const Key, Value>;
+   static const Key & key(const value_type & v) { return v.first; }
+};
+
+template <class Key>
+struct kind<Key, void> {
+   using value_type = Key;
+   static const Key & key(const Key & v) { return v; }
+};
+
+} //namespace tree23_detail
+
+template <class Key, class Value = void, class Compare = std::less<Key>,
+          class Alloc = std::allocator<
+             typename tree23_detail::kind<Key, Value>::value_type>>
+class tree23 {
+   using kind = tree23_detail::kind<Key, Value>;
+
+public:
+   using key_type = Key;
+   using mapped_type = Value;
+   using value_type = typename kind::value_type;
+   using size_type = std::size_t;
+   using difference_type = std::ptrdiff_t;
+   using key_compare = Compare;
+   using allocator_type = Alloc;
+   using reference = value_type &;
+   using const_reference = const value_type &;
+
+private:
+   /*
+    * Like the C node, minus the temporaries for overflowing 3-nodes: a
+    * split here moves values straight into the new sibling. A leaf has no
+    * children; every other node has count + 1 of them. The values are
+    * kept in raw storage so value_type needs no default constructor.
+    */
+   struct node {
+      node * parent;
+      node * child[3];
+      int count;
+      alignas(value_type) unsigned char slot[2][sizeof(value_type)];
+
+      value_type & val(int i) {
+         return *std::launder(reinterpret_cast<value_type *>(slot[i]));
+      }
+      bool leaf() const { return child[0] == nullptr; }
+      //Which child of its parent n is.
+      int which(const node * n) const {
+         return child[0] == n ? 0 : child[1] == n ? 1 : 2;
+      }
+   };
+
+   using node_alloc =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<node>;
+   using node_traits = std::allocator_traits<node_alloc>;
+
+   /*
+    * A position in the tree: value i of node n. The end position has a
+    * null node, and keeps the tree so that -- can find the largest value.
+    */
+   template <bool Const>
+   class iter {
+      friend class tree23;
+      template <bool> friend class iter;
+      node * n = nullptr;
+      int i = 0;
+      const tree23 * t = nullptr;
+
+      iter(node * n, int i, const tree23 * t) : n(n), i(i), t(t) {}
+
+   public:
+      using iterator_category = std::bidirectional_iterator_tag;
+      using value_type = typename tree23::value_type;
+      using difference_type = std::ptrdiff_t;
+      using pointer = std::conditional_t<Const, const value_type *,
+                                         value_type *>;
+      using reference = std::conditional_t<Const, const value_type &,
+                                           value_type &>;
+
+      iter() = default;
+      //Any iterator converts to a const one.
+      template <bool C, class = std::enable_if_t<Const && !C>>
+      iter(const iter<C> & other) : n(other.n), i(other.i), t(other.t) {}
+
+      reference operator*() const { return n->val(i); }
+      pointer operator->() const { return &n->val(i); }
+
+      //In order: down to the leftmost leaf right of value i, or on to the
+      //next value in the leaf, or up to the first ancestor that was
+      //reached from a child left of one of its values.
+      iter & operator++() {
+         if (!n->leaf()) {
+            n = n->child[i + 1];
+            while (!n->leaf())
+               n = n->child[0];
+            i = 0;
+         }
+         else if (i + 1 < n->count)
+            i++;
+         else {
+            while (n->parent != nullptr) {
+               int k = n->parent->which(n);
+               n = n->parent;
+               if (k < n->count) {
+                  i = k;
+                  return *this;
+               }
+            }
+            n = nullptr;
+         }
+         return *this;
+      }
+
+      iter & operator--() {
+         if (n == nullptr) {
+            n = t->rightmost();
+            i = n->count - 1;
+         }
+         else if (!n->leaf()) {
+            n = n->child[i];
+            while (!n->leaf())
+               n = n->child[n->count];
+            i = n->count - 1;
+         }
+         else if (i > 0)
+            i--;
+         else {
+            while (n->parent != nullptr) {
+               int k = n->parent->which(n);
+               n = n->parent;
+               if (k > 0) {
+                  i = k - 1;
+                  return *this;
+               }
+            }
+         }
+         return *this;
+      }
+
+      iter operator++(int) {
+         iter old = *this;
+         ++*this;
+         return old;
+      }
+      iter operator--(int) {
+         iter old = *this;
+         --*this;
+         return old;
+      }
+
+      template <bool C>
+      bool operator==(const iter<C> & other) const {
+         return n == other.n && (n == nullptr || i == other.i);
+      }
+      template <bool C>
+      bool operator!=(const iter<C> & other) const {
+         return !(*this == other);
+      }
+   };
+
+public:
+   //A set's values are its keys, so only a map's iterators can write.
+   using iterator = iter<std::is_void<Value>::value>;
+   using const_iterator = iter<true>;
+   using reverse_iterator = std::reverse_iterator<iterator>;
+   using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+   tree23() : tree23(Compare()) {}
+   explicit tree23(const Compare & comp, const Alloc & alloc = Alloc())
+      : comp(comp), mem(alloc) {}
+   explicit tree23(const Alloc & alloc) : tree23(Compare(), alloc) {}
+
+   template <class It>
+   tree23(It first, It last, const Compare & comp = Compare(),
+          const Alloc & alloc = Alloc())
+      : tree23(comp, alloc) {
+      insert(first, last);
+   }
+
+   tree23(std::initializer_list<value_type> vals,
+          const Compare & comp = Compare(), const Alloc & alloc = Alloc())
+      : tree23(vals.begin(), vals.end(), comp, alloc) {}
+
+   tree23(const tree23 & other)
+      : comp(other.comp),
+        mem(node_traits::select_on_container_copy_construction(other.mem)) {
+      root = clone(other.root, nullptr);
+      len = other.len;
+   }
+
+   tree23(tree23 && other) noexcept
+      : comp(std::move(other.comp)), mem(std::move(other.mem)) {
+      std::swap(root, other.root);
+      std::swap(len, other.len);
+   }
+
+   ~tree23() { clear(); }
+
+   //The copy is built in a tree of its own and swapped in, so a throw
+   //leaves this tree as it was.
+   tree23 & operator=(const tree23 & other) {
+      if (this != &other) {
+         tree23 copy(other.comp,
+                     node_traits::propagate_on_container_copy_assignment::
+                        value ? other.mem : mem, rebound());
+         copy.root = copy.clone(other.root, nullptr);
+         copy.len = other.len;
+         using std::swap;
+         swap(comp, copy.comp);
+         swap(mem, copy.mem);
+         swap(root, copy.root);
+         swap(len, copy.len);
+      }
+      return *this;
+   }
+
+   //Nodes can only be taken over if they can be freed through this
+   //tree's allocator afterwards; otherwise the values are moved one by one.
+   tree23 & operator=(tree23 && other) noexcept(
+      node_traits::propagate_on_container_move_assignment::value ||
+      node_traits::is_always_equal::value) {
+      if (this == &other)
+         return *this;
+      clear();
+      comp = std::move(other.comp);
+      if (node_traits::propagate_on_container_move_assignment::value)
+         mem = std::move(other.mem);
+      if (node_traits::propagate_on_container_move_assignment::value ||
+          mem == other.mem) {
+         std::swap(root, other.root);
+         std::swap(len, other.len);
+      }
+      else {
+         for (auto it = other.begin(); it != other.end(); ++it)
+            emplace_hint(end(), std::move(*it));
+         other.clear();
+      }
+      return *this;
+   }
+
+   tree23 & operator=(std::initializer_list<value_type> vals) {
+      clear();
+      insert(vals);
+      return *this;
+   }
+
+   allocator_type get_allocator() const { return allocator_type(mem); }
+   key_compare key_comp() const { return comp; }
+
+   iterator begin() { return iterator(leftmost(), 0, this); }
+   const_iterator begin() const {
+      return const_iterator(leftmost(), 0, this);
+   }
+   const_iterator cbegin() const { return begin(); }
+   iterator end() { return iterator(nullptr, 0, this); }
+   const_iterator end() const { return const_iterator(nullptr, 0, this); }
+   const_iterator cend() const { return end(); }
+   reverse_iterator rbegin() { return reverse_iterator(end()); }
+   const_reverse_iterator rbegin() const {
+      return const_reverse_iterator(end());
+   }
+   reverse_iterator rend() { return reverse_iterator(begin()); }
+   const_reverse_iterator rend() const {
+      return const_reverse_iterator(begin());
+   }
+
+   bool empty() const { return len == 0; }
+   size_type size() const { return len; }
+   size_type max_size() const { return node_traits::max_size(mem); }
+
+   void clear() {
+      destroy(root);
+      root = nullptr;
+      len = 0;
+   }
+
+   std::pair<iterator, bool> insert(const value_type & val) {
+      return place(kind::key(val), val);
+   }
+   std::pair<iterator, bool> insert(value_type && val) {
+      return place(kind::key(val), std::move(val));
+   }
+   iterator insert(const_iterator, const value_type & val) {
+      return insert(val).first;
+   }
+   iterator insert(const_iterator, value_type && val) {
+      return insert(std::move(val)).first;
+   }
+   template <class It>
+   void insert(It first, It last) {
+      for (; first != last; ++first)
+         emplace(*first);
+   }
+   void insert(std::initializer_list<value_type> vals) {
+      insert(vals.begin(), vals.end());
+   }
+
+   //The value has to be built before its key can be looked up, so it is
+   //built on the stack and moved into the tree if the key is new.
+   template <class... Args>
+   std::pair<iterator, bool> emplace(Args &&... args) {
+      value_type val(std::forward<Args>(args)...);
+      return place(kind::key(val), std::move(val));
+   }
+   template <class... Args>
+   iterator emplace_hint(const_iterator, Args &&... args) {
+      return emplace(std::forward<Args>(args)...).first;
+   }
+
+   //Maps only: builds the value from args only if key is new.
+   template <class... Args, class V = Value,
+             class = std::enable_if_t<!std::is_void<V>::value>>
+   std::pair<iterator, bool> try_emplace(const Key & key, Args &&... args) {
+      return place(key, std::piecewise_construct, std::forward_as_tuple(key),
+                   std::forward_as_tuple(std::forward<Args>(args)...));
+   }
+   template <class... Args, class V = Value,
+             class = std::enable_if_t<!std::is_void<V>::value>>
+   std::pair<iterator, bool> try_emplace(Key && key, Args &&... args) {
+      const Key & k = key;
+      return place(k, std::piecewise_construct,
+                   std::forward_as_tuple(std::move(key)),
+                   std::forward_as_tuple(std::forward<Args>(args)...));
+   }
+
+   template <class V = Value,
+             class = std::enable_if_t<!std::is_void<V>::value>>
+   V & operator[](const Key & key) {
+      return try_emplace(key).first->second;
+   }
+   template <class V = Value,
+             class = std::enable_if_t<!std::is_void<V>::value>>
+   V & operator[](Key && key) {
+      return try_emplace(std::move(key)).first->second;
+   }
+   template <class V = Value,
+             class = std::enable_if_t<!std::is_void<V>::value>>
+   V & at(const Key & key) {
+      iterator it = find(key);
+      if (it == end())
+         throw std::out_of_range("tree23::at");
+      return it->second;
+   }
+   template <class V = Value,
+             class = std::enable_if_t<!std::is_void<V>::value>>
+   const V & at(const Key & key) const {
+      const_iterator it = find(key);
+      if (it == end())
+         throw std::out_of_range("tree23::at");
+      return it->second;
+   }
+
+   //Removing a value can shuffle its neighbours between nodes, so the
+   //next one is followed through every move until the removal is done.
+   iterator erase(const_iterator pos) {
+      const_iterator next = std::next(pos);
+      track = next.n;
+      tracki = next.i;
+      remove(pos.n, pos.i);
+      iterator after(track, tracki, this);
+      track = nullptr;
+      return after;
+   }
+   //Only a map has writable iterators of its own to take; for a set this
+   //overload is never picked.
+   iterator erase(iter<false> pos) { return erase(const_iterator(pos)); }
+
+   //last's value may move while the ones before it are removed, so it is
+   //counted down to instead of compared against.
+   iterator erase(const_iterator first, const_iterator last) {
+      size_type n = std::distance(first, last);
+      iterator it(first.n, first.i, this);
+      while (n-- > 0)
+         it = erase(it);
+      return it;
+   }
+
+   size_type erase(const Key & key) {
+      const_iterator it = find(key);
+      if (it == end())
+         return 0;
+      remove(it.n, it.i);
+      return 1;
+   }
+
+   void swap(tree23 & other) noexcept {
+      using std::swap;
+      swap(comp, other.comp);
+      if (node_traits::propagate_on_container_swap::value)
+         swap(mem, other.mem);
+      swap(root, other.root);
+      swap(len, other.len);
+   }
+
+   iterator find(const Key & key) {
+      const_iterator it = std::as_const(*this).find(key);
+      return iterator(it.n, it.i, this);
+   }
+   const_iterator find(const Key & key) const {
+      node * n = root;
+      while (n != nullptr) {
+         int i = 0;
+         for (i = 0; i < n->count; i++) {
+            const Key & k = kind::key(n->val(i));
+            if (comp(key, k))
+               break;
+            if (!comp(k, key))
+               return const_iterator(n, i, this);
+         }
+         n = n->child[i];
+      }
+      return end();
+   }
+
+   size_type count(const Key & key) const { return find(key) != end(); }
+   bool contains(const Key & key) const { return find(key) != end(); }
+
+   iterator lower_bound(const Key & key) {
+      const_iterator it = std::as_const(*this).lower_bound(key);
+      return iterator(it.n, it.i, this);
+   }
+   const_iterator lower_bound(const Key & key) const {
+      return bound(key, false);
+   }
+   iterator upper_bound(const Key & key) {
+      const_iterator it = std::as_const(*this).upper_bound(key);
+      return iterator(it.n, it.i, this);
+   }
+   const_iterator upper_bound(const Key & key) const {
+      return bound(key, true);
+   }
+   std::pair<iterator, iterator> equal_range(const Key & key) {
+      return {lower_bound(key), upper_bound(key)};
+   }
+   std::pair<const_iterator, const_iterator>
+   equal_range(const Key & key) const {
+      return {lower_bound(key), upper_bound(key)};
+   }
+
+   //Checks the same invariants isvalid does: ordered values, and every
+   //leaf at the same depth. Returns false if any is broken.
+   bool valid() const {
+      int depth = -1;
+      size_type seen = 0;
+      return check(root, nullptr, nullptr, 0, depth, seen) && seen == len;
+   }
+
+   friend bool operator==(const tree23 & a, const tree23 & b) {
+      return a.size() == b.size() && std::equal(a.begin(), a.end(),
+                                                b.begin());
+   }
+   friend bool operator!=(const tree23 & a, const tree23 & b) {
+      return !(a == b);
+   }
+   friend void swap(tree23 & a, tree23 & b) noexcept { a.swap(b); }
+
+private:
+   //Picks the constructor that takes an allocator already rebound to node.
+   struct rebound {};
+
+   tree23(const Compare & comp, const node_alloc & mem, rebound)
+      : comp(comp), mem(mem) {}
+
+   node * root = nullptr;
+   size_type len = 0;
+   Compare comp;
+   node_alloc mem;
+   //While erase runs: where the value after the erased one is now.
+   node * track = nullptr;
+   int tracki = 0;
+
+   node * leftmost() const {
+      node * n = root;
+      while (n != nullptr && !n->leaf())
+         n = n->child[0];
+      return n;
+   }
+
+   node * rightmost() const {
+      node * n = root;
+      while (n != nullptr && !n->leaf())
+         n = n->child[n->count];
+      return n;
+   }
+
+   node * makenode(node * parent) {
+      node * n = node_traits::allocate(mem, 1);
+      n->parent = parent;
+      n->child[0] = n->child[1] = n->child[2] = nullptr;
+      n->count = 0;
+      return n;
+   }
+
+   template <class... Args>
+   void build(node * n, int i, Args &&... args) {
+      node_traits::construct(mem, &n->val(i), std::forward<Args>(args)...);
+   }
+
+   void unbuild(node * n, int i) { node_traits::destroy(mem, &n->val(i)); }
+
+   //Moves value si of src into the empty slot di of dst, following the
+   //value erase is keeping track of.
+   void relocate(node * dst, int di, node * src, int si) {
+      build(dst, di, std::move(src->val(si)));
+      unbuild(src, si);
+      if (src == track && si == tracki) {
+         track = dst;
+         tracki = di;
+      }
+   }
+
+   void destroy(node * n) {
+      if (n == nullptr)
+         return;
+      for (int i = 0; i <= n->count && !n->leaf(); i++)
+         destroy(n->child[i]);
+      for (int i = 0; i < n->count; i++)
+         unbuild(n, i);
+      node_traits::deallocate(mem, n, 1);
+   }
+
+   //n->count and the child pointers only ever cover what has been built,
+   //so if a copy throws, destroy frees exactly that before it goes on.
+   node * clone(node * from, node * parent) {
+      if (from == nullptr)
+         return nullptr;
+      node * n = makenode(parent);
+      try {
+         for (; n->count < from->count; n->count++)
+            build(n, n->count, from->val(n->count));
+         for (int i = 0; i <= n->count && !from->leaf(); i++)
+            n->child[i] = clone(from->child[i], n);
+      }
+      catch (...) {
+         destroy(n);
+         throw;
+      }
+      return n;
+   }
+
+   const_iterator bound(const Key & key, bool upper) const {
+      const_iterator best = end();
+      node * n = root;
+      while (n != nullptr) {
+         int i = 0;
+         for (i = 0; i < n->count; i++) {
+            const Key & k = kind::key(n->val(i));
+            if (upper ? comp(key, k) : !comp(k, key))
+               break;
+         }
+         if (i < n->count)
+            best = const_iterator(n, i, this);
+         n = n->child[i];
+      }
+      return best;
+   }
+
+   /*
+    * Descends to the leaf key belongs in, the same way insert does in
+    * tree23.c, and only builds the value from args once it knows the key
+    * isn't there already. Everything that can throw (building the value,
+    * allocating every node the splits will need) happens before the tree
+    * is touched, so a throw leaves the tree as it was, as long as moving
+    * a value doesn't throw.
+    */
+   template <class... Args>
+   std::pair<iterator, bool> place(const Key & key, Args &&... args) {
+      node * n = root;
+      int i = 0;
+      if (n == nullptr) {
+         std::optional<value_type> val;
+         val.emplace(std::forward<Args>(args)...);
+         root = makenode(nullptr);
+         build(root, 0, std::move(*val));
+         root->count = 1;
+         len = 1;
+         return {iterator(root, 0, this), true};
+      }
+      for (;;) {
+         for (i = 0; i < n->count; i++) {
+            const Key & k = kind::key(n->val(i));
+            if (comp(key, k))
+               break;
+            if (!comp(k, key))
+               return {iterator(n, i, this), false};
+         }
+         if (n->leaf())
+            break;
+         n = n->child[i];
+      }
+      std::optional<value_type> val;
+      val.emplace(std::forward<Args>(args)...);
+      if (n->count == 1) {
+         if (i == 0)
+            relocate(n, 1, n, 0);
+         build(n, i, std::move(*val));
+         n->count = 2;
+         len++;
+         return {iterator(n, i, this), true};
+      }
+      //One new sibling per full node on the way up, and a new root if
+      //the splits go all the way.
+      node * spare[66];
+      int need = 0;
+      int got = 0;
+      node * m = n;
+      for (; m != nullptr && m->count == 2; m = m->parent)
+         need++;
+      if (m == nullptr)
+         need++;
+      try {
+         for (; got < need; got++)
+            spare[got] = makenode(nullptr);
+      }
+      catch (...) {
+         while (got > 0)
+            node_traits::deallocate(mem, spare[--got], 1);
+         throw;
+      }
+      node * at = nullptr;
+      int ati = 0;
+      split(n, i, *val, nullptr, &at, &ati, spare);
+      len++;
+      return {iterator(at, ati, this), true};
+   }
+
+   /*
+    * Puts val into n at position i, with child r to its right. n is
+    * full, so it splits: the middle of its three values goes up to the
+    * parent, the value left of it stays in n and the value right of it
+    * goes to a new sibling. Stores where val ended up in *at, *ati, unless
+    * val itself is the one going up, in which case the parent does it.
+    * New nodes come from spare, which place filled with enough of them.
+    */
+   void split(node * n, int i, value_type & val, node * r, node ** at,
+              int * ati, node ** spare) {
+      if (n->count == 1) {
+         if (i == 0) {
+            relocate(n, 1, n, 0);
+            n->child[2] = n->child[1];
+         }
+         build(n, i, std::move(val));
+         n->child[i + 1] = r;
+         if (r != nullptr)
+            r->parent = n;
+         n->count = 2;
+         if (*at == nullptr) {
+            *at = n;
+            *ati = i;
+         }
+         return;
+      }
+      node * sib = *spare++;
+      sib->parent = n->parent;
+      std::optional<value_type> mid;
+      node * kids[4];
+      if (i == 0) {
+         mid.emplace(std::move(n->val(0)));
+         unbuild(n, 0);
+         build(n, 0, std::move(val));
+         relocate(sib, 0, n, 1);
+         kids[0] = n->child[0];
+         kids[1] = r;
+         kids[2] = n->child[1];
+         kids[3] = n->child[2];
+      }
+      else if (i == 1) {
+         mid.emplace(std::move(val));
+         relocate(sib, 0, n, 1);
+         kids[0] = n->child[0];
+         kids[1] = n->child[1];
+         kids[2] = r;
+         kids[3] = n->child[2];
+      }
+      else {
+         mid.emplace(std::move(n->val(1)));
+         unbuild(n, 1);
+         build(sib, 0, std::move(val));
+         kids[0] = n->child[0];
+         kids[1] = n->child[1];
+         kids[2] = n->child[2];
+         kids[3] = r;
+      }
+      if (*at == nullptr && i != 1) {
+         *at = i == 0 ? n : sib;
+         *ati = 0;
+      }
+      n->count = 1;
+      sib->count = 1;
+      n->child[0] = kids[0];
+      n->child[1] = kids[1];
+      n->child[2] = nullptr;
+      sib->child[0] = kids[2];
+      sib->child[1] = kids[3];
+      for (int k = 0; k < 2 && kids[k + 2] != nullptr; k++)
+         kids[k + 2]->parent = sib;
+      for (int k = 0; k < 2 && kids[k] != nullptr; k++)
+         kids[k]->parent = n;
+      if (n->parent == nullptr) {
+         root = *spare++;
+         build(root, 0, std::move(*mid));
+         root->count = 1;
+         root->child[0] = n;
+         root->child[1] = sib;
+         n->parent = sib->parent = root;
+         if (*at == nullptr) {
+            *at = root;
+            *ati = 0;
+         }
+         return;
+      }
+      split(n->parent, n->parent->which(n), *mid, sib, at, ati, spare);
+   }
+
+   /*
+    * A value in an internal node is swapped for its in-order successor,
+    * which is always in a leaf, so only leaves ever lose a value.
+    */
+   void remove(node * n, int i) {
+      if (!n->leaf()) {
+         node * leaf = n->child[i + 1];
+         while (!leaf->leaf())
+            leaf = leaf->child[0];
+         unbuild(n, i);
+         relocate(n, i, leaf, 0);
+         n = leaf;
+         i = 0;
+      }
+      else
+         unbuild(n, i);
+      len--;
+      if (i == 0 && n->count == 2)
+         relocate(n, 0, n, 1);
+      if (--n->count == 0)
+         underflow(n);
+   }
+
+   /*
+    * n has no values left and at most one child. If a neighbouring sibling
+    * is a 3-node, n takes the separating value from the parent and the
+    * parent takes the sibling's nearest value. Otherwise n's sibling takes
+    * the separating value and n's child, and n goes away; if that empties
+    * the parent, the parent is fixed up in turn.
+    */
+   void underflow(node * n) {
+      node * p = n->parent;
+      if (p == nullptr) {
+         root = n->child[0];
+         if (root != nullptr)
+            root->parent = nullptr;
+         node_traits::deallocate(mem, n, 1);
+         return;
+      }
+      int k = p->which(n);
+      node * left = k > 0 ? p->child[k - 1] : nullptr;
+      node * right = k < p->count ? p->child[k + 1] : nullptr;
+      if (right != nullptr && right->count == 2) {
+         relocate(n, 0, p, k);
+         relocate(p, k, right, 0);
+         relocate(right, 0, right, 1);
+         n->child[1] = right->child[0];
+         if (n->child[1] != nullptr)
+            n->child[1]->parent = n;
+         right->child[0] = right->child[1];
+         right->child[1] = right->child[2];
+         right->child[2] = nullptr;
+         n->count = 1;
+         right->count = 1;
+         return;
+      }
+      if (left != nullptr && left->count == 2) {
+         relocate(n, 0, p, k - 1);
+         relocate(p, k - 1, left, 1);
+         n->child[1] = n->child[0];
+         n->child[0] = left->child[2];
+         if (n->child[0] != nullptr)
+            n->child[0]->parent = n;
+         left->child[2] = nullptr;
+         n->count = 1;
+         left->count = 1;
+         return;
+      }
+      if (left != nullptr) {
+         relocate(left, 1, p, k - 1);
+         left->child[2] = n->child[0];
+         if (n->child[0] != nullptr)
+            n->child[0]->parent = left;
+         left->count = 2;
+         if (k == 1 && p->count == 2)
+            relocate(p, 0, p, 1);
+         for (int c = k; c < p->count; c++)
+            p->child[c] = p->child[c + 1];
+      }
+      else {
+         relocate(right, 1, right, 0);
+         relocate(right, 0, p, 0);
+         right->child[2] = right->child[1];
+         right->child[1] = right->child[0];
+         right->child[0] = n->child[0];
+         if (n->child[0] != nullptr)
+            n->child[0]->parent = right;
+         right->count = 2;
+         if (p->count == 2)
+            relocate(p, 0, p, 1);
+         p->child[0] = p->child[1];
+         p->child[1] = p->child[2];
+      }
+      p->child[p->count] = nullptr;
+      node_traits::deallocate(mem, n, 1);
+      if (--p->count == 0)
+         underflow(p);
+   }
+
+   bool check(node * n, const Key * lo, const Key * hi, int depth,
+              int & leafdepth, size_type & seen) const {
+      const Key * first = lo;
+      if (n == nullptr)
+         return depth == 0;
+      for (int i = 0; i < n->count; i++) {
+         const Key & k = kind::key(n->val(i));
+         if ((lo != nullptr && !comp(*lo, k)) ||
+             (hi != nullptr && !comp(k, *hi)))
+            return false;
+         lo = &k;
+      }
+      seen += n->count;
+      if (n->leaf()) {
+         if (leafdepth < 0)
+            leafdepth = depth;
+         return leafdepth == depth;
+      }
+      for (int i = 0; i <= n->count; i++) {
+         const Key * above = i > 0 ? &kind::key(n->val(i - 1)) : first;
+         const Key * below = i < n->count ? &kind::key(n->val(i)) : hi;
+         if (n->child[i] == nullptr || n->child[i]->parent != n ||
+             !check(n->child[i], above, below, depth + 1, leafdepth, seen))
+            return false;
+      }
+      return true;
+   }
+};
+
+#endif
@@ -0,0 +1,424 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "treeio.h"
+/*
+ * "treeio.c", by Sean Soderman
+ * Bulk movement of tree contents to and from files. Everything here goes
+ * through big user-space buffers and raw read()/write() calls, since stdio
+ * turned out to be far slower than the tree itself for large dumps.
+ */
+
+#ifndef EXPORT_BUFLEN
+#define EXPORT_BUFLEN (1 << 20)
+#endif
+
+#ifndef INGEST_BUFLEN
+#define INGEST_BUFLEN (1 << 20)
+#endif
+
+//Keys handed to insert_batch at a time once the input stops being sorted.
+#ifndef INGEST_CHUNK
+#define INGEST_CHUNK (1 << 16)
+#endif
+
+//Longest string fmtfloat can produce: FLT_MAX printed with "%f" is 39
+//digits, plus sign, point, six decimals and the newline.
+#define MAX_FLOAT_CHARS 64
+
+//Writes all len bytes of buf to fd, riding out short writes and signals.
+static bool writeall(int fd, const char * buf, size_t len);
+//Formats val exactly like printf's "%f" and appends a newline.
+static int fmtfloat(float val, char * out);
+
+/*
+ * Collects parsed keys on their way into the tree. While everything seen so
+ * far is ascending and the tree started out empty, keys pile up for a
+ * single bulkload at the end. Once a key arrives out of order, the pile is
+ * drained through insert_batch whenever it fills up.
+ */
+typedef struct i {
+   tree * t;
+   float * keys;
+   uint64_t len;
+   uint64_t cap;
+   uint64_t total;
+   bool sorted;
+}ingester;
+
+//Queues one parsed key.
+static void feed(ingester * in, float val);
+//Parses every complete text token in [p, end). Returns where the first
+//incomplete token starts, or end. If final is set, nothing is incomplete.
+static const char * parsetext(ingester * in, const char * p,
+                              const char * end, bool final);
+//Parses one number token. Returns false if it wasn't a number after all.
+static bool parsefloat(const char * p, const char * end, float * out);
+//Parses one word token, with an optional sign in front. Returns false
+//unless the word is inf, infinity or nan, in any case.
+static bool parseword(const char * p, const char * end, float * out);
+//True for an ASCII letter.
+static bool isletter(char c);
+//Queues every whole 4-byte key in [p, end). Returns where the leftovers
+//start.
+static const char * parsebinary(ingester * in, const char * p,
+                                const char * end);
+
+static const double powers_of_ten[] = {
+   1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+   1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const char digit_pairs[] =
+   "00010203040506070809101112131415161718192021222324252627282930313233"
+   "34353637383940414243444546474849505152535455565758596061626364656667"
+   "6869707172737475767778798081828384858687888990919293949596979899";
+
+/*
+ * Walks the tree in order with an explicit stack instead of recursion,
+ * filling a large buffer that is only handed to the kernel when nearly
+ * full. Each stack frame remembers how far through its node the walk is:
+ * 0 = left subtree next, 1 = ldata and middle next, 2 = rdata and right
+ * next, 3 = done.
+ */
+bool tree_export(node * root, int fd, key_format fmt) {
+   node * stack[128];
+   int state[128];
+   int top = 0;
+   size_t used = 0;
+   bool ok = true;
+   char * buf = malloc(EXPORT_BUFLEN);
+   if (buf == NULL)
+      return false;
+   if (root->is2node || root->is3node) {
+      stack[0] = root;
+      state[0] = 0;
+      top = 1;
+   }
+   while (top > 0 && ok) {
+      node * n = stack[top - 1];
+      node * next = NULL;
+      float val = 0;
+      bool emit = false;
+      switch (state[top - 1]++) {
+         case 0:
+            next = n->left;
+            break;
+         case 1:
+            val = fromkey(n->ldata);
+            emit = true;
+            next = n->middle;
+            break;
+         case 2:
+            val = fromkey(n->rdata);
+            emit = n->is3node;
+            next = n->right;
+            break;
+         default:
+            top--;
+            continue;
+      }
+      if (emit) {
+         if (EXPORT_BUFLEN - used < MAX_FLOAT_CHARS) {
+            ok = writeall(fd, buf, used);
+            used = 0;
+         }
+         if (fmt == KEYS_BINARY) {
+            uint32_t bits;
+            memcpy(&bits, &val, sizeof(bits));
+            buf[used++] = (char)(bits & 0xff);
+            buf[used++] = (char)((bits >> 8) & 0xff);
+            buf[used++] = (char)((bits >> 16) & 0xff);
+            buf[used++] = (char)(bits >> 24);
+         }
+         else
+            used += fmtfloat(val, buf + used);
+      }
+      if (next != NULL) {
+         stack[top] = next;
+         state[top] = 0;
+         top++;
+      }
+   }
+   if (ok && used > 0)
+      ok = writeall(fd, buf, used);
+   free(buf);
+   return ok;
+}
+
+static bool writeall(int fd, const char * buf, size_t len) {
+   while (len > 0) {
+      ssize_t written = write(fd, buf, len);
+      if (written < 0) {
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+      buf += written;
+      len -= written;
+   }
+   return true;
+}
+
+/*
+ * A float times 10^6 is always exact in a double (24 + 20 significant
+ * bits), so below 2^63 the six-decimal rounding "%f" does is just a round
+ * half to even of that product, and the digits come out of integer
+ * arithmetic two at a time. Anything bigger (or inf/NaN) is rare enough to
+ * hand to snprintf.
+ */
+static int fmtfloat(float val, char * out) {
+   double d = val;
+   uint32_t bits;
+   memcpy(&bits, &val, sizeof(bits));
+   double mag = (bits >> 31) ? -d : d;
+   if (!(mag < 9e12)) {
+      int len = snprintf(out, MAX_FLOAT_CHARS - 1, "%f", d);
+      out[len] = '\n';
+      return len + 1;
+   }
+   char * p = out;
+   if (bits >> 31)
+      *p++ = '-';
+   double scaled = mag * 1e6;
+   uint64_t fixed = (uint64_t)scaled;
+   double rem = scaled - (double)fixed;
+   if (rem > 0.5 || (rem == 0.5 && (fixed & 1)))
+      fixed++;
+   uint64_t whole = fixed / 1000000;
+   uint32_t frac = (uint32_t)(fixed % 1000000);
+   //Integer part, produced backwards into a scratch buffer.
+   char tmp[24];
+   int len = 0;
+   while (whole >= 100) {
+      uint32_t pair = (uint32_t)(whole % 100) * 2;
+      whole /= 100;
+      tmp[len++] = digit_pairs[pair + 1];
+      tmp[len++] = digit_pairs[pair];
+   }
+   if (whole >= 10) {
+      tmp[len++] = digit_pairs[whole * 2 + 1];
+      tmp[len++] = digit_pairs[whole * 2];
+   }
+   else
+      tmp[len++] = (char)('0' + whole);
+   while (len > 0)
+      *p++ = tmp[--len];
+   *p++ = '.';
+   memcpy(p, digit_pairs + (frac / 10000) * 2, 2);
+   memcpy(p + 2, digit_pairs + (frac / 100 % 100) * 2, 2);
+   memcpy(p + 4, digit_pairs + (frac % 100) * 2, 2);
+   p[6] = '\n';
+   return (int)(p + 7 - out);
+}
+
+/*
+ * Regular files are mapped whole and parsed in place. Pipes and ttys can't
+ * be mapped, so they are read a buffer at a time, carrying any token that
+ * straddles the end of the buffer over to the next read.
+ */
+int64_t tree_ingest(tree * root, int fd, key_format fmt) {
+   ingester in;
+   struct stat st;
+   bool ok = true;
+   in.t = root;
+   in.len = 0;
+   in.cap = INGEST_CHUNK;
+   in.total = 0;
+   in.keys = malloc(sizeof(float) * in.cap);
+   in.sorted = !root->root->is2node && !root->root->is3node &&
+               root->snaps == NULL;
+   char * map = MAP_FAILED;
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (map != MAP_FAILED) {
+      (void)madvise(map, st.st_size, MADV_SEQUENTIAL);
+      if (fmt == KEYS_BINARY)
+         (void)parsebinary(&in, map, map + st.st_size);
+      else
+         (void)parsetext(&in, map, map + st.st_size, true);
+      munmap(map, st.st_size);
+   }
+   else {
+      char * buf = malloc(INGEST_BUFLEN);
+      size_t carry = 0;
+      while (true) {
+         ssize_t got = read(fd, buf + carry, INGEST_BUFLEN - carry);
+         if (got < 0 && errno == EINTR)
+            continue;
+         if (got < 0) {
+            ok = false;
+            break;
+         }
+         char * end = buf + carry + got;
+         const char * rest;
+         if (fmt == KEYS_BINARY)
+            rest = parsebinary(&in, buf, end);
+         else
+            rest = parsetext(&in, buf, end, got == 0);
+         //A single token filling the whole buffer will never complete.
+         if (rest == buf && end - buf == INGEST_BUFLEN)
+            rest = parsetext(&in, buf, end, true);
+         carry = end - rest;
+         memmove(buf, rest, carry);
+         if (got == 0)
+            break;
+      }
+      free(buf);
+   }
+   if (in.sorted)
+      bulkload(in.keys, in.len, root);
+   else
+      insert_batch(in.keys, in.len, root);
+   free(in.keys);
+   return ok ? (int64_t)in.total : -1;
+}
+
+static void feed(ingester * in, float val) {
+   if (in->sorted && in->len > 0 && val < in->keys[in->len - 1])
+      in->sorted = false;
+   if (in->len == in->cap) {
+      if (in->sorted) {
+         in->cap *= 2;
+         in->keys = realloc(in->keys, sizeof(float) * in->cap);
+      }
+      else {
+         insert_batch(in->keys, in->len, in->t);
+         in->len = 0;
+      }
+   }
+   in->keys[in->len++] = val;
+   in->total++;
+}
+
+/*
+ * Anything that can't start a number or a word is treated as a separator.
+ * Words are taken whole, so the infinities and NaNs tree_export writes
+ * come back, while treeprint's "ldata: " labels are skipped over as well
+ * as whitespace.
+ */
+static const char * parsetext(ingester * in, const char * p,
+                              const char * end, bool final) {
+   while (p < end) {
+      char c = *p;
+      const char * start = p;
+      if ((c == '-' || c == '+') && p + 1 < end && isletter(p[1]))
+         p++;
+      if (isletter(*p)) {
+         while (p < end && isletter(*p))
+            p++;
+         if (p == end && !final)
+            return start;
+         float val;
+         if (parseword(start, p, &val))
+            feed(in, val);
+         continue;
+      }
+      if ((c < '0' || c > '9') && c != '-' && c != '+' && c != '.') {
+         p++;
+         continue;
+      }
+      while (p < end && ((*p >= '0' && *p <= '9') || *p == '.' ||
+             *p == '-' || *p == '+' || *p == 'e' || *p == 'E'))
+         p++;
+      if (p == end && !final)
+         return start;
+      float val;
+      if (parsefloat(start, p, &val))
+         feed(in, val);
+   }
+   return end;
+}
+
+/*
+ * strtof already knows these words and keeps a NaN's sign, so a matching
+ * word is just copied out for it.
+ */
+static bool parseword(const char * p, const char * end, float * out) {
+   char buf[16];
+   const char * word = *p == '-' || *p == '+' ? p + 1 : p;
+   size_t len = end - word;
+   if (!(len == 3 && strncasecmp(word, "inf", 3) == 0) &&
+       !(len == 8 && strncasecmp(word, "infinity", 8) == 0) &&
+       !(len == 3 && strncasecmp(word, "nan", 3) == 0))
+      return false;
+   memcpy(buf, p, end - p);
+   buf[end - p] = '\0';
+   *out = strtof(buf, NULL);
+   return true;
+}
+
+static bool isletter(char c) {
+   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/*
+ * Plain decimals of up to 19 digits are read into an integer mantissa. If
+ * it fits in 53 bits, mantissa / 10^k is one correctly rounded double
+ * division. Rounding that double to float is a second rounding, which can
+ * land on the wrong side of a halfway point between two floats: the exact
+ * value may sit just off the halfway point while the double lands on it
+ * or across it. The double is off by at most half a double ulp, so that
+ * can only happen when it is within one double ulp of a halfway point,
+ * where the 29 bits a float drops are 2^28 give or take one. Those, and
+ * exponents and longer inputs, go through strtof. Every fast path key is
+ * at least 1e-22 and below 2^53, so it is a normal float and dropping 29
+ * bits is exactly what rounding to float does.
+ */
+static bool parsefloat(const char * p, const char * end, float * out) {
+   const char * start = p;
+   bool neg = false;
+   uint64_t mant = 0;
+   int digits = 0;
+   int frac = 0;
+   if (*p == '-' || *p == '+')
+      neg = *p++ == '-';
+   while (p < end && *p >= '0' && *p <= '9') {
+      mant = mant * 10 + (*p++ - '0');
+      digits++;
+   }
+   if (p < end && *p == '.') {
+      p++;
+      while (p < end && *p >= '0' && *p <= '9') {
+         mant = mant * 10 + (*p++ - '0');
+         digits++;
+         frac++;
+      }
+   }
+   if (p == end && digits > 0 && digits <= 19 &&
+       mant <= (1ULL << 53) && frac <= 22) {
+      double val = (double)mant / powers_of_ten[frac];
+      uint64_t bits;
+      memcpy(&bits, &val, sizeof(bits));
+      uint64_t dropped = bits & ((1ULL << 29) - 1);
+      if (dropped - ((1ULL << 28) - 1) > 2) {
+         *out = (float)(neg ? -val : val);
+         return true;
+      }
+   }
+   char tmp[128];
+   char * stop;
+   size_t len = end - start < 127 ? end - start : 127;
+   memcpy(tmp, start, len);
+   tmp[len] = '\0';
+   *out = strtof(tmp, &stop);
+   return stop != tmp;
+}
+
+static const char * parsebinary(ingester * in, const char * p,
+                                const char * end) {
+   const unsigned char * b = (const unsigned char *)p;
+   for (; end - (const char *)b >= 4; b += 4) {
+      uint32_t bits = (uint32_t)b[0] | (uint32_t)b[1] << 8 |
+                      (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+      float val;
+      memcpy(&val, &bits, sizeof(val));
+      feed(in, val);
+   }
+   return (const char *)b;
+}
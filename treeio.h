@@ -0,0 +1,30 @@
+/*
+ * "treeio.h", by Sean Soderman
+ * Specification of functions that move tree contents to and from files.
+ */
+#ifndef TREEIO_H
+#define TREEIO_H
+
+#include "tree23.h"
+
+/*
+ * How keys are laid out in a file. KEYS_TEXT is one "%f"-style value per
+ * line, the same as the dump file main.c writes. KEYS_BINARY is a bare
+ * run of 32-bit little-endian IEEE floats.
+ */
+typedef enum k {
+   KEYS_TEXT,
+   KEYS_BINARY
+}key_format;
+
+//Writes every value in the tree rooted at root to fd, in order.
+//Returns false if a write failed, with errno left as write() set it.
+bool tree_export(node * root, int fd, key_format fmt);
+
+//Reads every key in fd into the tree. Regular files are mmapped, anything
+//else (pipes, stdin) is streamed. Sorted input going into an empty tree is
+//bulk loaded, everything else is inserted in sorted chunks.
+//Returns the number of keys read, or -1 if reading failed.
+int64_t tree_ingest(tree * root, int fd, key_format fmt);
+
+#endif
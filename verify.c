@@ -0,0 +1,306 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "verify.h"
+/*
+ * "verify.c", by Sean Soderman
+ * Validates a whole tree. Every key is checked against the tightest bounds
+ * its ancestors put on it, not just its parent's keys, so a key that is
+ * fine next to its parent but on the wrong side of its grandparent is
+ * still caught.
+ */
+
+//Taller than any 2-3 tree that fits in memory could be, so a spine that
+//goes deeper than this has a cycle in it.
+#define VERIFY_MAX_HEIGHT 64
+
+/*
+ * A subtree to validate, with the range its keys must fall in, and what
+ * validating it found.
+ */
+typedef struct vt {
+   node * n;
+   sortkey lo;
+   sortkey hi;
+   uint64_t depth;
+   uint64_t height;
+   verify_report found;
+}task;
+
+/*
+ * Every task, and the threads sharing them out: thread i takes tasks i,
+ * i + nthreads, i + 2 * nthreads and so on. The subtrees are all the same
+ * height, so they take about the same time.
+ */
+typedef struct vw {
+   task * tasks;
+   uint64_t ntasks;
+   int nthreads;
+   int id;
+}worker;
+
+//Checks n on its own: its kind, its children's presence and parent
+//pointers, its keys' order and bounds, and its depth if it is a leaf.
+//Returns false if the subtree below it can't be trusted to walk.
+static bool checknode(node * n, sortkey lo, sortkey hi, uint64_t depth,
+                      uint64_t height, verify_report * rep);
+//Counts a problem in rep, and describes it if it is the first.
+static void flag(verify_report * rep, verify_code code, node * n,
+                 uint64_t depth);
+//Checks the subtree n and everything below it.
+static void walk(node * n, sortkey lo, sortkey hi, uint64_t depth,
+                 uint64_t height, verify_report * rep);
+//Checks the top levels of the tree, down to split, and appends every
+//subtree at depth split to tasks. *before is set to the number of tasks
+//appended before the first problem in the top levels.
+static void top(node * n, sortkey lo, sortkey hi, uint64_t depth,
+                uint64_t split, uint64_t height, verify_report * rep,
+                task ** tasks, uint64_t * ntasks, uint64_t * cap,
+                uint64_t * before);
+//Runs one thread's share of the tasks.
+static void * verifyworker(void * arg);
+//Adds the counts in from to into.
+static void add(verify_report * into, verify_report * from);
+
+/*
+ * The leftmost path gives the height every leaf must be at; one longer
+ * than VERIFY_MAX_HEIGHT can only be a cycle, and is reported as a leaf
+ * at the wrong depth without walking any further. The top
+ * levels are checked here, down to where there are at least eight
+ * subtrees per thread, and the subtrees are then checked in parallel. The
+ * first problem is picked the way a one-thread walk would have found it:
+ * a task's problem wins over the top levels' only if the task comes
+ * earlier in that walk.
+ */
+verify_report tree_verify(tree * root, int nthreads) {
+   verify_report rep = {VERIFY_OK, NULL, 0, 0, 0, 0, 0};
+   node * n = root->root;
+   uint64_t split = 0;
+   uint64_t cap = 64;
+   uint64_t ntasks = 0;
+   uint64_t before = 0;
+   uint64_t i = 0;
+   int t = 0;
+   if (nthreads < 1)
+      nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (nthreads < 1)
+      nthreads = 1;
+   while (n->left != NULL) {
+      if (++rep.height > VERIFY_MAX_HEIGHT) {
+         flag(&rep, VERIFY_DEPTH, n, VERIFY_MAX_HEIGHT);
+         rep.height = 0;
+         return rep;
+      }
+      n = n->left;
+   }
+   while (split < rep.height && (1ULL << split) < 8ULL * nthreads)
+      split++;
+   task * tasks = malloc(sizeof(task) * cap);
+   if (root->root->parent != NULL)
+      flag(&rep, VERIFY_PARENT, root->root, 0);
+   top(root->root, 0, UINT32_MAX, 0, split, rep.height, &rep, &tasks,
+       &ntasks, &cap, &before);
+   if (rep.code == VERIFY_OK)
+      before = ntasks;
+   pthread_t * threads = malloc(sizeof(pthread_t) * nthreads);
+   bool * started = calloc(nthreads, sizeof(bool));
+   worker * jobs = malloc(sizeof(worker) * nthreads);
+   for (t = 0; t < nthreads; t++) {
+      jobs[t].tasks = tasks;
+      jobs[t].ntasks = ntasks;
+      jobs[t].nthreads = nthreads;
+      jobs[t].id = t;
+      //Thread 0's share is done right here, as is any thread's that
+      //couldn't be started.
+      started[t] = t > 0 && pthread_create(&threads[t], NULL, verifyworker,
+                                           &jobs[t]) == 0;
+   }
+   for (t = 0; t < nthreads; t++) {
+      if (!started[t])
+         (void)verifyworker(&jobs[t]);
+   }
+   for (t = 0; t < nthreads; t++) {
+      if (started[t])
+         pthread_join(threads[t], NULL);
+   }
+   for (i = 0; i < ntasks; i++) {
+      verify_report * found = &tasks[i].found;
+      if (found->code != VERIFY_OK && i < before) {
+         rep.code = found->code;
+         rep.where = found->where;
+         rep.depth = found->depth;
+         before = i;
+      }
+      add(&rep, found);
+   }
+   //The caches and the buffer only matter once the nodes are sound.
+   if (rep.code == VERIFY_OK) {
+      node * first = root->root;
+      node * last = root->root;
+      //The walk found every leaf at this height, so the spines end there.
+      for (i = 0; i < rep.height; i++) {
+         first = first->left;
+         last = last->right;
+      }
+      if ((root->minleaf != NULL && root->minleaf != first) ||
+          (root->maxleaf != NULL && root->maxleaf != last))
+         flag(&rep, VERIFY_CACHE, root->minleaf != first ? root->minleaf :
+                                  root->maxleaf, 0);
+      for (i = 1; i < root->pending_sorted; i++) {
+         //i - 1 ends a run when run_end holds i; the next one starts anew.
+         bool boundary = false;
+         int r = 0;
+         for (r = 0; r < root->runs; r++)
+            boundary |= root->run_end[r] == i;
+         if (!boundary && root->pending[i - 1].key > root->pending[i].key) {
+            flag(&rep, VERIFY_BUFFER, NULL, 0);
+            break;
+         }
+      }
+   }
+   free(tasks);
+   free(threads);
+   free(started);
+   free(jobs);
+   return rep;
+}
+
+const char * verify_describe(verify_code code) {
+   switch (code) {
+      case VERIFY_OK:
+         return "valid";
+      case VERIFY_KIND:
+         return "node is not exactly one of a 2-node and a 3-node";
+      case VERIFY_SHAPE:
+         return "children don't match the node's kind";
+      case VERIFY_PARENT:
+         return "parent pointer doesn't point at the parent";
+      case VERIFY_ORDER:
+         return "key out of order";
+      case VERIFY_DEPTH:
+         return "leaf at the wrong depth";
+      case VERIFY_CACHE:
+         return "cached min or max leaf is stale";
+      case VERIFY_BUFFER:
+         return "buffered writes out of order";
+   }
+   return "unknown";
+}
+
+/*
+ * Keys may equal their bounds: after deletions, copies of a key can sit
+ * on either side of a separator equal to it. The only childless node
+ * with no keys allowed is the root of an empty tree.
+ */
+static bool checknode(node * n, sortkey lo, sortkey hi, uint64_t depth,
+                      uint64_t height, verify_report * rep) {
+   bool leaf = n->left == NULL && n->middle == NULL && n->right == NULL;
+   bool deeper = !leaf;
+   verify_code code = VERIFY_OK;
+   rep->nodes++;
+   if (!n->is2node && !n->is3node && leaf && depth == 0)
+      return false;
+   if (n->is2node == n->is3node || n->is4node || n->mid_right != NULL) {
+      code = VERIFY_KIND;
+      deeper = false;
+   }
+   else if (!leaf && (n->left == NULL || n->right == NULL ||
+                      (n->middle == NULL) != n->is2node)) {
+      code = VERIFY_SHAPE;
+      deeper = false;
+   }
+   else if (n->ldata < lo || n->ldata > hi ||
+            (n->is3node && (n->rdata < n->ldata || n->rdata > hi)))
+      code = VERIFY_ORDER;
+   else if ((n->left != NULL && n->left->parent != n) ||
+            (n->middle != NULL && n->middle->parent != n) ||
+            (n->right != NULL && n->right->parent != n))
+      code = VERIFY_PARENT;
+   //Stopping at the leaves' depth, whatever else is wrong with the node,
+   //also keeps a cycle of child pointers from being walked forever.
+   if (leaf != (depth == height)) {
+      if (code == VERIFY_OK)
+         code = VERIFY_DEPTH;
+      deeper = false;
+   }
+   if (code != VERIFY_KIND && code != VERIFY_SHAPE)
+      rep->keys += n->is3node ? 2 : 1;
+   if (code != VERIFY_OK)
+      flag(rep, code, n, depth);
+   return deeper;
+}
+
+static void flag(verify_report * rep, verify_code code, node * n,
+                 uint64_t depth) {
+   if (rep->code == VERIFY_OK) {
+      rep->code = code;
+      rep->where = n;
+      rep->depth = depth;
+   }
+   rep->problems++;
+}
+
+static void walk(node * n, sortkey lo, sortkey hi, uint64_t depth,
+                 uint64_t height, verify_report * rep) {
+   if (!checknode(n, lo, hi, depth, height, rep))
+      return;
+   if (n->is3node) {
+      walk(n->left, lo, n->ldata, depth + 1, height, rep);
+      walk(n->middle, n->ldata, n->rdata, depth + 1, height, rep);
+      walk(n->right, n->rdata, hi, depth + 1, height, rep);
+   }
+   else {
+      walk(n->left, lo, n->ldata, depth + 1, height, rep);
+      walk(n->right, n->ldata, hi, depth + 1, height, rep);
+   }
+}
+
+static void top(node * n, sortkey lo, sortkey hi, uint64_t depth,
+                uint64_t split, uint64_t height, verify_report * rep,
+                task ** tasks, uint64_t * ntasks, uint64_t * cap,
+                uint64_t * before) {
+   if (depth == split) {
+      if (*ntasks == *cap) {
+         *cap *= 2;
+         *tasks = realloc(*tasks, sizeof(task) * *cap);
+      }
+      task * job = &(*tasks)[(*ntasks)++];
+      job->n = n;
+      job->lo = lo;
+      job->hi = hi;
+      job->depth = depth;
+      job->height = height;
+      return;
+   }
+   bool clean = rep->code == VERIFY_OK;
+   bool deeper = checknode(n, lo, hi, depth, height, rep);
+   if (clean && rep->code != VERIFY_OK)
+      *before = *ntasks;
+   if (!deeper)
+      return;
+   top(n->left, lo, n->ldata, depth + 1, split, height, rep, tasks, ntasks,
+       cap, before);
+   if (n->is3node)
+      top(n->middle, n->ldata, n->rdata, depth + 1, split, height, rep,
+          tasks, ntasks, cap, before);
+   top(n->right, n->is3node ? n->rdata : n->ldata, hi, depth + 1, split,
+       height, rep, tasks, ntasks, cap, before);
+}
+
+static void * verifyworker(void * arg) {
+   worker * job = arg;
+   uint64_t i = 0;
+   for (i = job->id; i < job->ntasks; i += job->nthreads) {
+      task * t = &job->tasks[i];
+      verify_report fresh = {VERIFY_OK, NULL, 0, 0, 0, 0, 0};
+      t->found = fresh;
+      walk(t->n, t->lo, t->hi, t->depth, t->height, &t->found);
+   }
+   return NULL;
+}
+
+static void add(verify_report * into, verify_report * from) {
+   into->problems += from->problems;
+   into->nodes += from->nodes;
+   into->keys += from->keys;
+}
@@ -0,0 +1,48 @@
+/*
+ * "verify.h", by Sean Soderman
+ * Specification of the full tree validator: every 2-3 invariant, checked
+ * over subtrees in parallel, with the findings returned instead of
+ * printed.
+ */
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "tree23.h"
+
+//What can be wrong with a tree.
+typedef enum {
+   VERIFY_OK,     //Every invariant holds.
+   VERIFY_KIND,   //Not exactly one of is2node and is3node, or is4node set.
+   VERIFY_SHAPE,  //Children missing, or there when the kind says not.
+   VERIFY_PARENT, //A child whose parent pointer isn't its parent.
+   VERIFY_ORDER,  //A key out of order, in its node or against an ancestor.
+   VERIFY_DEPTH,  //A leaf at a different depth from the leftmost one.
+   VERIFY_CACHE,  //minleaf or maxleaf isn't the leaf it claims to be.
+   VERIFY_BUFFER  //A run of buffered writes that isn't in key order.
+}verify_code;
+
+/*
+ * The outcome of tree_verify. Only the first problem is described, the
+ * one a single-threaded, top-down walk would reach first; problems counts
+ * every node with something wrong.
+ */
+typedef struct vr {
+   verify_code code;
+   node * where;      //The node the first problem is in, if any.
+   uint64_t depth;    //That node's distance from the root.
+   uint64_t problems;
+   uint64_t nodes;
+   uint64_t keys;
+   uint64_t height;   //Depth of the leftmost leaf (0 if the root is one).
+}verify_report;
+
+//Checks every invariant of the tree, with the subtrees below the top few
+//levels split over nthreads threads (one per CPU if nthreads < 1). The
+//tree is only read, so it must not be written to meanwhile. Writes still
+//waiting in a buffered tree are checked for order, not applied.
+verify_report tree_verify(tree * root, int nthreads);
+
+//Returns a short description of a verify_code.
+const char * verify_describe(verify_code code);
+
+#endif